@@ -0,0 +1,227 @@
+#include "fs.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+using namespace std;
+
+// Microbenchmarks of the fs.h operations. Every configuration (device size x directory fan-out)
+// gets a freshly formatted temporary image, results are printed as one JSON object per operation:
+//
+//   fs_bench [--mode stream|posix|mmap] [--block-size N] [--sizes MB,...] [--fanouts N,...] [--dir DIR]
+
+// INTERNAL LINKAGE SECTION
+namespace {
+
+const int SEQUENTIAL_CHUNK = 64 * 1024;
+const int RANDOM_CHUNK = 4 * 1024;
+const int RANDOM_OPS = 1024;
+const int LS_OPS = 16;
+const int TRUNCATE_SIZE = 4 * 1024;
+
+struct Config final {
+    string mode_name = "posix";
+    myfs::DeviceMode mode = myfs::DeviceMode::Posix;
+    int block_size = myfs::DEFAULT_BLOCK_SIZE;
+    vector<int> sizes_mb{16, 128};
+    vector<int> fanouts{16, 256, 2048};
+    string dir = "/tmp";
+};
+
+vector<int> parse_list(const string& text) {
+    vector<int> result;
+    istringstream in(text);
+    string item;
+    while (getline(in, item, ',')) {
+        result.push_back(atoi(item.c_str()));
+    }
+    return result;
+}
+
+bool parse_args(int argc, char** argv, Config* config) {
+    for (int i = 1; i + 1 < argc; i += 2) {
+        string option = argv[i];
+        string value = argv[i + 1];
+        if (option == "--mode") {
+            config->mode_name = value;
+            if (value == "stream") {
+                config->mode = myfs::DeviceMode::Stream;
+            } else if (value == "posix") {
+                config->mode = myfs::DeviceMode::Posix;
+            } else if (value == "mmap") {
+                config->mode = myfs::DeviceMode::Mmap;
+            } else {
+                return false;
+            }
+        } else if (option == "--block-size") {
+            config->block_size = atoi(value.c_str());
+        } else if (option == "--sizes") {
+            config->sizes_mb = parse_list(value);
+        } else if (option == "--fanouts") {
+            config->fanouts = parse_list(value);
+        } else if (option == "--dir") {
+            config->dir = value;
+        } else {
+            return false;
+        }
+    }
+    return argc % 2 == 1;
+}
+
+// Runs operation(i) for i in [0, n), timing every call. Device requests are counted
+// up to the sync which follows the phase, the sync itself isn't timed.
+template <typename Operation>
+void run_phase(const Config& config, int size_mb, int fanout, myfs::Filesystem& fs,
+               const string& op, int n, long bytes_per_op, Operation operation) {
+    auto device_before = fs.device_stats();
+    vector<long> latencies; // ns
+    latencies.reserve(static_cast<size_t>(n));
+    auto phase_start = chrono::steady_clock::now();
+    for (int i = 0; i < n; ++i) {
+        auto start = chrono::steady_clock::now();
+        operation(i);
+        latencies.push_back(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+    }
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - phase_start).count();
+    fs.sync();
+    auto device_after = fs.device_stats();
+
+    sort(latencies.begin(), latencies.end());
+    auto percentile_us = [&latencies](int p) {
+        if (latencies.empty()) {
+            return 0.0;
+        }
+        size_t index = min(latencies.size() - 1, latencies.size() * p / 100);
+        return latencies[index] / 1000.0;
+    };
+    printf("{\"mode\":\"%s\",\"block_size\":%d,\"device_mb\":%d,\"fanout\":%d,\"op\":\"%s\",\"ops\":%d,\"seconds\":%.6f,"
+           "\"ops_per_sec\":%.1f,\"mb_per_sec\":%.2f,\"p50_us\":%.2f,\"p90_us\":%.2f,\"p99_us\":%.2f,\"max_us\":%.2f,"
+           "\"device_reads\":%ld,\"device_writes\":%ld,\"device_bytes_read\":%ld,\"device_bytes_written\":%ld}\n",
+           config.mode_name.c_str(), config.block_size, size_mb, fanout, op.c_str(), n, seconds,
+           seconds > 0 ? n / seconds : 0.0, seconds > 0 ? n * bytes_per_op / seconds / (1024 * 1024) : 0.0,
+           percentile_us(50), percentile_us(90), percentile_us(99), latencies.empty() ? 0.0 : latencies.back() / 1000.0,
+           device_after.reads - device_before.reads, device_after.writes - device_before.writes,
+           device_after.bytes_read - device_before.bytes_read, device_after.bytes_written - device_before.bytes_written);
+    fflush(stdout);
+}
+
+string make_image(const Config& config, int size_mb) {
+    string path = config.dir + "/fs_bench.XXXXXX";
+    int fd = mkstemp(&path[0]);
+    if (fd == -1) {
+        return "";
+    }
+    bool ok = ftruncate(fd, static_cast<off_t>(size_mb) * 1024 * 1024) == 0;
+    ::close(fd);
+    if (!ok) {
+        unlink(path.c_str());
+        return "";
+    }
+    return path;
+}
+
+bool bench(const Config& config, int size_mb, int fanout) {
+    string image = make_image(config, size_mb);
+    if (image.empty()) {
+        cerr << "Cannot create an image in " << config.dir << endl;
+        return false;
+    }
+    myfs::Filesystem fs;
+    if (!fs.mkfs(image, config.block_size, config.mode) || !fs.mount(image, config.mode)) {
+        cerr << "Cannot mount " << image << endl;
+        unlink(image.c_str());
+        return false;
+    }
+    mt19937 random(42);
+    auto dir_name = [](int i) { return "/dirs/d" + to_string(i); };
+    auto file_name = [](int i) { return "/files/f" + to_string(i); };
+    fs.mkdir("/dirs");
+    fs.mkdir("/files");
+    fs.sync();
+
+    run_phase(config, size_mb, fanout, fs, "mkdir", fanout, 0, [&](int i) {
+        fs.mkdir(dir_name(i));
+    });
+    run_phase(config, size_mb, fanout, fs, "create", fanout, 0, [&](int i) {
+        fs.create(file_name(i));
+    });
+    run_phase(config, size_mb, fanout, fs, "lookup", 4 * fanout, 0, [&](int) {
+        fs.file_exists(file_name(static_cast<int>(random() % fanout)));
+    });
+    run_phase(config, size_mb, fanout, fs, "lookup_miss", fanout, 0, [&](int i) {
+        fs.file_exists("/files/x" + to_string(i));
+    });
+    run_phase(config, size_mb, fanout, fs, "ls", LS_OPS, 0, [&](int) {
+        fs.ls("/files");
+    });
+    run_phase(config, size_mb, fanout, fs, "truncate", fanout, 0, [&](int i) {
+        myfs::File{fs, file_name(i)}.truncate(TRUNCATE_SIZE);
+    });
+
+    // a quarter of the device in one file
+    long big_size = static_cast<long>(size_mb) * 1024 * 1024 / 4 / SEQUENTIAL_CHUNK * SEQUENTIAL_CHUNK;
+    fs.create("/big");
+    myfs::File big{fs, "/big"};
+    big.truncate(big_size);
+    fs.sync();
+    vector<char> chunk(SEQUENTIAL_CHUNK, 'x');
+    int n_chunks = static_cast<int>(big_size / SEQUENTIAL_CHUNK);
+    run_phase(config, size_mb, fanout, fs, "write_seq", n_chunks, SEQUENTIAL_CHUNK, [&](int i) {
+        big.write(chunk.data(), SEQUENTIAL_CHUNK, static_cast<long>(i) * SEQUENTIAL_CHUNK);
+    });
+    run_phase(config, size_mb, fanout, fs, "read_seq", n_chunks, SEQUENTIAL_CHUNK, [&](int i) {
+        big.read(chunk.data(), SEQUENTIAL_CHUNK, static_cast<long>(i) * SEQUENTIAL_CHUNK);
+    });
+    // the same stream in small reads through a descriptor
+    int fd = fs.open("/big");
+    run_phase(config, size_mb, fanout, fs, "read_seq_fd", static_cast<int>(big_size / RANDOM_CHUNK), RANDOM_CHUNK, [&](int) {
+        fs.read(fd, chunk.data(), RANDOM_CHUNK);
+    });
+    fs.close(fd);
+    long n_random_slots = big_size / RANDOM_CHUNK;
+    run_phase(config, size_mb, fanout, fs, "write_rand", RANDOM_OPS, RANDOM_CHUNK, [&](int) {
+        big.write(chunk.data(), RANDOM_CHUNK, static_cast<long>(random() % n_random_slots) * RANDOM_CHUNK);
+    });
+    run_phase(config, size_mb, fanout, fs, "read_rand", RANDOM_OPS, RANDOM_CHUNK, [&](int) {
+        big.read(chunk.data(), RANDOM_CHUNK, static_cast<long>(random() % n_random_slots) * RANDOM_CHUNK);
+    });
+    big.close();
+
+    run_phase(config, size_mb, fanout, fs, "unlink", fanout, 0, [&](int i) {
+        fs.unlink(file_name(i));
+    });
+    run_phase(config, size_mb, fanout, fs, "rmdir", fanout, 0, [&](int i) {
+        fs.rmdir(dir_name(i));
+    });
+
+    fs.umount();
+    unlink(image.c_str());
+    return true;
+}
+} // END OF INTERNAL LINKAGE SECTION
+
+int main(int argc, char** argv) {
+    Config config;
+    if (!parse_args(argc, argv, &config)) {
+        cerr << "usage: " << argv[0] << " [--mode stream|posix|mmap] [--block-size N] [--sizes MB,...] [--fanouts N,...] [--dir DIR]"
+             << endl;
+        return 1;
+    }
+    for (int size_mb : config.sizes_mb) {
+        for (int fanout : config.fanouts) {
+            if (!bench(config, size_mb, fanout)) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,810 @@
+#include "device.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cerrno>
+#include <climits>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <linux/io_uring.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+using namespace std;
+
+namespace myfs {
+
+void Device::readv(long offset, const iovec* iov, int iovcnt) {
+    for (int i = 0; i < iovcnt; ++i) {
+        read(offset, static_cast<char*>(iov[i].iov_base), static_cast<int>(iov[i].iov_len));
+        offset += iov[i].iov_len;
+    }
+}
+
+void Device::writev(long offset, const iovec* iov, int iovcnt) {
+    for (int i = 0; i < iovcnt; ++i) {
+        write(offset, static_cast<const char*>(iov[i].iov_base), static_cast<int>(iov[i].iov_len));
+        offset += iov[i].iov_len;
+    }
+}
+
+future<void> Device::submit_readv(long offset, const iovec* iov, int iovcnt) {
+    promise<void> done;
+    try {
+        readv(offset, iov, iovcnt);
+        done.set_value();
+    } catch (const DeviceError&) {
+        done.set_exception(current_exception());
+    }
+    return done.get_future();
+}
+
+future<void> Device::submit_writev(long offset, const iovec* iov, int iovcnt) {
+    promise<void> done;
+    try {
+        writev(offset, iov, iovcnt);
+        done.set_value();
+    } catch (const DeviceError&) {
+        done.set_exception(current_exception());
+    }
+    return done.get_future();
+}
+
+char* Device::mapping() {
+    return nullptr;
+}
+
+DeviceStats Device::stats() const {
+    return DeviceStats{};
+}
+
+// INTERNAL LINKAGE SECTION
+namespace {
+
+// fstream has a single file position, so requests are serialized. fstream can only hand the data to
+// the kernel, so the image is opened once more for fsync.
+struct StreamDevice final : Device {
+    explicit StreamDevice(const string& filename);
+    ~StreamDevice() override;
+    bool is_open() const;
+    long capacity() const override;
+    void read(long offset, char* data, int size) override;
+    void write(long offset, const char* data, int size) override;
+    void sync() override;
+private:
+    mutex lock;
+    fstream fio;
+    int fd = -1; // for sync() only
+    long size = -1;
+};
+
+const int IO_QUEUE_DEPTH = 128; // requests in flight of an io_uring engine
+const int IO_THREADS = 4; // threads of the fallback engine
+
+// Skips n transferred bytes of iov starting from iov[*next], a short transfer may stop in the middle of a buffer
+void skip_transferred(vector<iovec>& iov, size_t* next, size_t n) {
+    for (; *next < iov.size() && n >= iov[*next].iov_len; ++*next) {
+        n -= iov[*next].iov_len;
+    }
+    if (n > 0) {
+        iov[*next].iov_base = static_cast<char*>(iov[*next].iov_base) + n;
+        iov[*next].iov_len -= n;
+    }
+}
+
+// Repeats a preadv/pwritev-like call until all the buffers are transferred, throws DeviceError on
+// errors and at the end of the device
+template <typename Transfer>
+void transfer_all(Transfer transfer, long offset, const iovec* iov, int iovcnt) {
+    vector<iovec> rest(iov, iov + iovcnt);
+    size_t next = 0;
+    while (next < rest.size()) {
+        auto n = transfer(&rest[next], static_cast<int>(min(rest.size() - next, static_cast<size_t>(IOV_MAX))), offset);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1) {
+            throw DeviceError{string{"device request failed: "} + strerror(errno)};
+        }
+        if (n == 0) {
+            throw DeviceError{"device request past the end of the device"};
+        }
+        offset += n;
+        skip_transferred(rest, &next, static_cast<size_t>(n));
+    }
+}
+
+// Size of a regular file or of a block device in bytes, -1 on errors
+long device_size(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        return -1;
+    }
+    if (S_ISBLK(st.st_mode)) {
+        uint64_t size;
+        return ioctl(fd, BLKGETSIZE64, &size) == 0 ? static_cast<long>(size) : -1;
+    }
+    return st.st_size;
+}
+
+// Forwards requests to another device and counts them
+struct CountingDevice final : Device {
+    explicit CountingDevice(unique_ptr<Device> device);
+    long capacity() const override;
+    void read(long offset, char* data, int size) override;
+    void write(long offset, const char* data, int size) override;
+    void readv(long offset, const iovec* iov, int iovcnt) override;
+    void writev(long offset, const iovec* iov, int iovcnt) override;
+    future<void> submit_readv(long offset, const iovec* iov, int iovcnt) override;
+    future<void> submit_writev(long offset, const iovec* iov, int iovcnt) override;
+    void sync() override;
+    char* mapping() override;
+    DeviceStats stats() const override;
+private:
+    void count_read(const iovec* iov, int iovcnt);
+    void count_write(const iovec* iov, int iovcnt);
+    unique_ptr<Device> device;
+    atomic<long> reads{0};
+    atomic<long> writes{0};
+    atomic<long> bytes_read{0};
+    atomic<long> bytes_written{0};
+};
+
+// Asynchronous request: what is left to transfer and who waits for it
+struct IORequest final {
+    bool write;
+    long offset;
+    vector<iovec> iov;
+    size_t next = 0; // first buffer which isn't transferred completely
+    string error; // of a failed request
+    promise<void> done;
+};
+
+// Runs asynchronous requests on a file descriptor
+struct IOEngine {
+    virtual ~IOEngine() = default;
+    virtual void submit(unique_ptr<IORequest> request) = 0;
+};
+
+// Linux io_uring: a request is put into the submission ring and passed to the kernel with one
+// io_uring_enter call, a reaper thread waits for completions and resubmits short transfers.
+// At most IO_QUEUE_DEPTH requests are in flight, so the completion ring never overflows.
+// Requests which the kernel refuses fail with DeviceError, so does everything in flight when waiting
+// for completions fails (the engine is broken then and fails all later requests at once).
+struct UringEngine final : IOEngine {
+    explicit UringEngine(int fd);
+    ~UringEngine() override;
+    bool is_open() const;
+    void submit(unique_ptr<IORequest> request) override;
+private:
+    bool push(IORequest* request, uint64_t user_data); // lock must be held, false if the kernel refused it
+    void reap();
+    static void finish(IORequest* request);
+    int fd;
+    int ring_fd = -1;
+    void* sq_ring = MAP_FAILED;
+    size_t sq_ring_size = 0;
+    void* cq_ring = MAP_FAILED;
+    size_t cq_ring_size = 0;
+    io_uring_sqe* sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+    size_t sqes_size = 0;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    io_uring_cqe* cqes;
+    mutex lock;
+    condition_variable has_room;
+    int n_in_flight = 0;
+    unordered_set<IORequest*> in_flight; // guarded by lock
+    bool broken = false; // the reaper has stopped on an error, guarded by lock
+    thread reaper;
+};
+
+// Fallback for kernels without io_uring: a few threads doing blocking preadv/pwritev calls
+struct ThreadPoolEngine final : IOEngine {
+    ThreadPoolEngine(int fd, int n_threads);
+    ~ThreadPoolEngine() override;
+    void submit(unique_ptr<IORequest> request) override;
+private:
+    void run();
+    int fd;
+    mutex lock;
+    condition_variable has_requests;
+    deque<unique_ptr<IORequest>> requests;
+    bool stopping = false;
+    vector<thread> threads;
+};
+
+// Positioned reads and writes on a file descriptor, one syscall per (scatter/gather) request.
+struct PosixDevice final : Device {
+    explicit PosixDevice(const string& filename);
+    ~PosixDevice() override;
+    bool is_open() const;
+    long capacity() const override;
+    void read(long offset, char* data, int size) override;
+    void write(long offset, const char* data, int size) override;
+    void readv(long offset, const iovec* iov, int iovcnt) override;
+    void writev(long offset, const iovec* iov, int iovcnt) override;
+    future<void> submit_readv(long offset, const iovec* iov, int iovcnt) override;
+    future<void> submit_writev(long offset, const iovec* iov, int iovcnt) override;
+    void sync() override;
+private:
+    future<void> submit(bool write, long offset, const iovec* iov, int iovcnt);
+    int fd = -1;
+    long size = -1;
+    unique_ptr<IOEngine> engine;
+};
+
+// Whole image is mapped into memory, reads and writes are plain copies.
+struct MmapDevice final : Device {
+    explicit MmapDevice(const string& filename);
+    ~MmapDevice() override;
+    bool is_open() const;
+    long capacity() const override;
+    void read(long offset, char* data, int size) override;
+    void write(long offset, const char* data, int size) override;
+    void sync() override;
+    char* mapping() override;
+private:
+    int fd = -1;
+    char* base = nullptr;
+    long size = -1;
+};
+
+StreamDevice::StreamDevice(const string& filename) {
+    fio.open(filename, fstream::in | fstream::binary | fstream::out);
+    if (!fio.fail()) {
+        fio.seekg(0, fio.end);
+        size = fio.tellg();
+    }
+    fd = ::open(filename.c_str(), O_RDWR);
+}
+
+StreamDevice::~StreamDevice() {
+    if (fd != -1) {
+        ::close(fd);
+    }
+}
+
+bool StreamDevice::is_open() const {
+    return fio.is_open() && fd != -1 && size != -1;
+}
+
+long StreamDevice::capacity() const {
+    return size;
+}
+
+void StreamDevice::read(long offset, char* data, int size) {
+    lock_guard<mutex> guard{lock};
+    fio.seekg(offset, fio.beg);
+    fio.read(data, size);
+    if (fio.gcount() != size) {
+        fio.clear();
+        throw DeviceError{"device read failed"};
+    }
+}
+
+void StreamDevice::write(long offset, const char* data, int size) {
+    lock_guard<mutex> guard{lock};
+    fio.seekp(offset, fio.beg);
+    fio.write(data, size);
+    if (fio.fail()) {
+        fio.clear();
+        throw DeviceError{"device write failed"};
+    }
+}
+
+void StreamDevice::sync() {
+    lock_guard<mutex> guard{lock};
+    fio.flush();
+    if (fio.fail()) {
+        fio.clear();
+        throw DeviceError{"device write failed"};
+    }
+    if (fsync(fd) == -1) {
+        throw DeviceError{string{"device sync failed: "} + strerror(errno)};
+    }
+}
+
+PosixDevice::PosixDevice(const string& filename) {
+    fd = ::open(filename.c_str(), O_RDWR);
+    if (fd == -1) {
+        return;
+    }
+    size = device_size(fd);
+    unique_ptr<UringEngine> uring{new UringEngine(fd)};
+    if (uring->is_open()) {
+        engine = move(uring);
+    } else {
+        engine.reset(new ThreadPoolEngine(fd, IO_THREADS));
+    }
+}
+
+PosixDevice::~PosixDevice() {
+    engine.reset();
+    if (fd != -1) {
+        ::close(fd);
+    }
+}
+
+bool PosixDevice::is_open() const {
+    return fd != -1 && size != -1;
+}
+
+long PosixDevice::capacity() const {
+    return size;
+}
+
+void PosixDevice::read(long offset, char* data, int size) {
+    iovec iov{data, static_cast<size_t>(size)};
+    readv(offset, &iov, 1);
+}
+
+void PosixDevice::write(long offset, const char* data, int size) {
+    iovec iov{const_cast<char*>(data), static_cast<size_t>(size)};
+    writev(offset, &iov, 1);
+}
+
+void PosixDevice::readv(long offset, const iovec* iov, int iovcnt) {
+    transfer_all([this](const iovec* iov, int iovcnt, long offset) {
+        return ::preadv(fd, iov, iovcnt, offset);
+    }, offset, iov, iovcnt);
+}
+
+void PosixDevice::writev(long offset, const iovec* iov, int iovcnt) {
+    transfer_all([this](const iovec* iov, int iovcnt, long offset) {
+        return ::pwritev(fd, iov, iovcnt, offset);
+    }, offset, iov, iovcnt);
+}
+
+future<void> PosixDevice::submit_readv(long offset, const iovec* iov, int iovcnt) {
+    return submit(false, offset, iov, iovcnt);
+}
+
+future<void> PosixDevice::submit_writev(long offset, const iovec* iov, int iovcnt) {
+    return submit(true, offset, iov, iovcnt);
+}
+
+future<void> PosixDevice::submit(bool write, long offset, const iovec* iov, int iovcnt) {
+    unique_ptr<IORequest> request{new IORequest{write, offset, vector<iovec>(iov, iov + iovcnt)}};
+    auto done = request->done.get_future();
+    engine->submit(move(request));
+    return done;
+}
+
+void PosixDevice::sync() {
+    if (fsync(fd) == -1) {
+        throw DeviceError{string{"device sync failed: "} + strerror(errno)};
+    }
+}
+
+UringEngine::UringEngine(int fd) : fd(fd) {
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring_fd = static_cast<int>(syscall(__NR_io_uring_setup, IO_QUEUE_DEPTH, &params));
+    if (ring_fd == -1) {
+        return;
+    }
+    sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single_mmap) {
+        sq_ring_size = cq_ring_size = max(sq_ring_size, cq_ring_size);
+    }
+    sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if (sq_ring == MAP_FAILED) {
+        return;
+    }
+    if (single_mmap) {
+        cq_ring = sq_ring;
+    } else {
+        cq_ring = mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+        if (cq_ring == MAP_FAILED) {
+            return;
+        }
+    }
+    sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    sqes = static_cast<io_uring_sqe*>(mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES));
+    if (sqes == MAP_FAILED) {
+        return;
+    }
+    auto sq = static_cast<char*>(sq_ring);
+    sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sq_mask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    auto cq = static_cast<char*>(cq_ring);
+    cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cq_mask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+    reaper = thread{&UringEngine::reap, this};
+}
+
+UringEngine::~UringEngine() {
+    if (reaper.joinable()) {
+        // a no-op request without user data stops the reaper. A ring which refuses it is broken,
+        // then waiting fails as well and the reaper stops by itself
+        {
+            unique_lock<mutex> guard{lock};
+            has_room.wait(guard, [this] { return broken || n_in_flight < IO_QUEUE_DEPTH; });
+            if (!broken) {
+                ++n_in_flight;
+                push(nullptr, 0);
+            }
+        }
+        reaper.join();
+    }
+    if (sqes != MAP_FAILED) {
+        munmap(sqes, sqes_size);
+    }
+    if (cq_ring != MAP_FAILED && cq_ring != sq_ring) {
+        munmap(cq_ring, cq_ring_size);
+    }
+    if (sq_ring != MAP_FAILED) {
+        munmap(sq_ring, sq_ring_size);
+    }
+    if (ring_fd != -1) {
+        ::close(ring_fd);
+    }
+}
+
+bool UringEngine::is_open() const {
+    return reaper.joinable();
+}
+
+void UringEngine::submit(unique_ptr<IORequest> request) {
+    {
+        unique_lock<mutex> guard{lock};
+        has_room.wait(guard, [this] { return broken || n_in_flight < IO_QUEUE_DEPTH; });
+        if (broken) {
+            request->error = "io_uring is broken";
+        } else {
+            ++n_in_flight;
+            if (push(request.get(), reinterpret_cast<uint64_t>(request.get()))) {
+                in_flight.insert(request.release());
+                return;
+            }
+            --n_in_flight;
+            request->error = string{"io_uring submission failed: "} + strerror(errno);
+        }
+    }
+    has_room.notify_all();
+    finish(request.release());
+}
+
+// Fulfils the promise of a request which is done and frees it
+void UringEngine::finish(IORequest* request) {
+    if (request->error.empty()) {
+        request->done.set_value();
+    } else {
+        request->done.set_exception(make_exception_ptr(DeviceError{request->error}));
+    }
+    delete request;
+}
+
+bool UringEngine::push(IORequest* request, uint64_t user_data) {
+    // the ring has as many entries as requests may be in flight, so there's always a free one
+    unsigned tail = *sq_tail;
+    unsigned index = tail & *sq_mask;
+    io_uring_sqe& sqe = sqes[index];
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.user_data = user_data;
+    if (request == nullptr) {
+        sqe.opcode = IORING_OP_NOP;
+    } else {
+        sqe.opcode = request->write ? IORING_OP_WRITEV : IORING_OP_READV;
+        sqe.fd = fd;
+        sqe.off = static_cast<uint64_t>(request->offset);
+        sqe.addr = reinterpret_cast<uint64_t>(&request->iov[request->next]);
+        sqe.len = static_cast<uint32_t>(min(request->iov.size() - request->next, static_cast<size_t>(IOV_MAX)));
+    }
+    sq_array[index] = index;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    long n_submitted;
+    while (true) {
+        n_submitted = syscall(__NR_io_uring_enter, ring_fd, 1, 0, 0, nullptr, 0);
+        if (n_submitted != -1 || (errno != EINTR && errno != EAGAIN && errno != EBUSY)) {
+            break;
+        }
+        // EAGAIN and EBUSY: short of kernel resources for a moment, the completion ring itself
+        // can't overflow (see the class comment)
+        this_thread::yield();
+    }
+    if (n_submitted == -1) {
+        // the kernel consumed nothing, the entry is taken back
+        int error = errno;
+        __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+        errno = error;
+        return false;
+    }
+    return true;
+}
+
+void UringEngine::reap() {
+    bool stopping = false;
+    vector<IORequest*> finished;
+    while (!stopping) {
+        if (syscall(__NR_io_uring_enter, ring_fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // completions can't be waited for any more: everything in flight fails, so do later requests
+            string error = string{"io_uring wait failed: "} + strerror(errno);
+            {
+                lock_guard<mutex> guard{lock};
+                broken = true;
+                for (auto request : in_flight) {
+                    request->error = error;
+                    finished.push_back(request);
+                }
+                in_flight.clear();
+                n_in_flight = 0;
+            }
+            stopping = true;
+        } else {
+            // requests were pushed under the lock, taking it makes their fields visible here
+            lock_guard<mutex> guard{lock};
+            unsigned head = *cq_head;
+            unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+            for (; head != tail; ++head) {
+                const io_uring_cqe& cqe = cqes[head & *cq_mask];
+                auto request = reinterpret_cast<IORequest*>(cqe.user_data);
+                int result = cqe.res;
+                // the entry may be reused as soon as the head moves
+                __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+                if (request == nullptr) {
+                    stopping = true;
+                    continue;
+                }
+                if (result <= 0 && result != -EINTR && result != -EAGAIN) {
+                    // errors and the end of the device fail the whole request
+                    request->error = result == 0 ? string{"device request past the end of the device"}
+                            : string{"device request failed: "} + strerror(-result);
+                    request->next = request->iov.size();
+                } else if (result > 0) {
+                    request->offset += result;
+                    skip_transferred(request->iov, &request->next, static_cast<size_t>(result));
+                }
+                if (request->next < request->iov.size()) {
+                    if (push(request, reinterpret_cast<uint64_t>(request))) {
+                        continue;
+                    }
+                    request->error = string{"io_uring submission failed: "} + strerror(errno);
+                }
+                in_flight.erase(request);
+                finished.push_back(request);
+                --n_in_flight;
+            }
+        }
+        has_room.notify_all();
+        for (auto request : finished) {
+            finish(request);
+        }
+        finished.clear();
+    }
+}
+
+ThreadPoolEngine::ThreadPoolEngine(int fd, int n_threads) : fd(fd) {
+    for (int i = 0; i < n_threads; ++i) {
+        threads.emplace_back(&ThreadPoolEngine::run, this);
+    }
+}
+
+ThreadPoolEngine::~ThreadPoolEngine() {
+    {
+        lock_guard<mutex> guard{lock};
+        stopping = true;
+    }
+    has_requests.notify_all();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+void ThreadPoolEngine::submit(unique_ptr<IORequest> request) {
+    {
+        lock_guard<mutex> guard{lock};
+        requests.push_back(move(request));
+    }
+    has_requests.notify_one();
+}
+
+void ThreadPoolEngine::run() {
+    while (true) {
+        unique_ptr<IORequest> request;
+        {
+            unique_lock<mutex> guard{lock};
+            has_requests.wait(guard, [this] { return stopping || !requests.empty(); });
+            if (requests.empty()) {
+                return;
+            }
+            request = move(requests.front());
+            requests.pop_front();
+        }
+        try {
+            if (request->write) {
+                transfer_all([this](const iovec* iov, int iovcnt, long offset) {
+                    return ::pwritev(fd, iov, iovcnt, offset);
+                }, request->offset, request->iov.data(), static_cast<int>(request->iov.size()));
+            } else {
+                transfer_all([this](const iovec* iov, int iovcnt, long offset) {
+                    return ::preadv(fd, iov, iovcnt, offset);
+                }, request->offset, request->iov.data(), static_cast<int>(request->iov.size()));
+            }
+        } catch (const DeviceError&) {
+            request->done.set_exception(current_exception());
+            continue;
+        }
+        request->done.set_value();
+    }
+}
+
+MmapDevice::MmapDevice(const string& filename) {
+    fd = ::open(filename.c_str(), O_RDWR);
+    if (fd == -1) {
+        return;
+    }
+    long device_bytes = device_size(fd);
+    if (device_bytes <= 0) {
+        return;
+    }
+    void* addr = mmap(nullptr, static_cast<size_t>(device_bytes), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+        return;
+    }
+    base = static_cast<char*>(addr);
+    size = device_bytes;
+}
+
+MmapDevice::~MmapDevice() {
+    if (base != nullptr) {
+        munmap(base, static_cast<size_t>(size));
+    }
+    if (fd != -1) {
+        ::close(fd);
+    }
+}
+
+bool MmapDevice::is_open() const {
+    return base != nullptr;
+}
+
+long MmapDevice::capacity() const {
+    return size;
+}
+
+void MmapDevice::read(long offset, char* data, int size) {
+    if (offset + size > this->size) {
+        throw DeviceError{"device request past the end of the device"};
+    }
+    memcpy(data, base + offset, static_cast<size_t>(size));
+}
+
+void MmapDevice::write(long offset, const char* data, int size) {
+    if (offset + size > this->size) {
+        throw DeviceError{"device request past the end of the device"};
+    }
+    memcpy(base + offset, data, static_cast<size_t>(size));
+}
+
+void MmapDevice::sync() {
+    if (msync(base, static_cast<size_t>(size), MS_SYNC) == -1) {
+        throw DeviceError{string{"device sync failed: "} + strerror(errno)};
+    }
+}
+
+char* MmapDevice::mapping() {
+    return base;
+}
+
+CountingDevice::CountingDevice(unique_ptr<Device> device) : device(move(device)) {
+}
+
+long CountingDevice::capacity() const {
+    return device->capacity();
+}
+
+void CountingDevice::read(long offset, char* data, int size) {
+    ++reads;
+    bytes_read += size;
+    device->read(offset, data, size);
+}
+
+void CountingDevice::write(long offset, const char* data, int size) {
+    ++writes;
+    bytes_written += size;
+    device->write(offset, data, size);
+}
+
+void CountingDevice::readv(long offset, const iovec* iov, int iovcnt) {
+    count_read(iov, iovcnt);
+    device->readv(offset, iov, iovcnt);
+}
+
+void CountingDevice::writev(long offset, const iovec* iov, int iovcnt) {
+    count_write(iov, iovcnt);
+    device->writev(offset, iov, iovcnt);
+}
+
+future<void> CountingDevice::submit_readv(long offset, const iovec* iov, int iovcnt) {
+    count_read(iov, iovcnt);
+    return device->submit_readv(offset, iov, iovcnt);
+}
+
+future<void> CountingDevice::submit_writev(long offset, const iovec* iov, int iovcnt) {
+    count_write(iov, iovcnt);
+    return device->submit_writev(offset, iov, iovcnt);
+}
+
+void CountingDevice::sync() {
+    device->sync();
+}
+
+char* CountingDevice::mapping() {
+    return device->mapping();
+}
+
+DeviceStats CountingDevice::stats() const {
+    DeviceStats result;
+    result.reads = reads;
+    result.writes = writes;
+    result.bytes_read = bytes_read;
+    result.bytes_written = bytes_written;
+    return result;
+}
+
+void CountingDevice::count_read(const iovec* iov, int iovcnt) {
+    ++reads;
+    for (int i = 0; i < iovcnt; ++i) {
+        bytes_read += static_cast<long>(iov[i].iov_len);
+    }
+}
+
+void CountingDevice::count_write(const iovec* iov, int iovcnt) {
+    ++writes;
+    for (int i = 0; i < iovcnt; ++i) {
+        bytes_written += static_cast<long>(iov[i].iov_len);
+    }
+}
+} // END OF INTERNAL LINKAGE SECTION
+
+unique_ptr<Device> open_device(const string& filename, DeviceMode mode) {
+    unique_ptr<Device> device;
+    if (mode == DeviceMode::Mmap) {
+        unique_ptr<MmapDevice> mmap_device{new MmapDevice(filename)};
+        if (mmap_device->is_open()) {
+            device = move(mmap_device);
+        }
+    } else if (mode == DeviceMode::Posix) {
+        unique_ptr<PosixDevice> posix_device{new PosixDevice(filename)};
+        if (posix_device->is_open()) {
+            device = move(posix_device);
+        }
+    } else {
+        unique_ptr<StreamDevice> stream_device{new StreamDevice(filename)};
+        if (stream_device->is_open()) {
+            device = move(stream_device);
+        }
+    }
+    if (device == nullptr) {
+        return nullptr;
+    }
+    return unique_ptr<Device>{new CountingDevice(move(device))};
+}
+} // END OF NAMESPACE myfs
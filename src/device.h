@@ -0,0 +1,39 @@
+#ifndef DEVICE_H
+#define DEVICE_H
+
+#include "fs.h"
+
+#include <future>
+#include <memory>
+#include <string>
+
+#include <sys/uio.h>
+
+namespace myfs
+{
+// Storage the file system lives on. Offsets and sizes are in bytes. Requests which fail or reach
+// past the end of the device throw DeviceError.
+struct Device {
+    virtual ~Device() = default;
+    virtual long capacity() const = 0;
+    virtual void read(long offset, char* data, int size) = 0;
+    virtual void write(long offset, const char* data, int size) = 0;
+    // scatter/gather versions, the default implementation calls read/write for every buffer
+    virtual void readv(long offset, const iovec* iov, int iovcnt);
+    virtual void writev(long offset, const iovec* iov, int iovcnt);
+    // asynchronous versions: the future gets ready when the request is done. The buffers (but not the
+    // iovec array) must stay valid until then, requests in flight may complete in any order.
+    // Failed requests make get() throw DeviceError. The default implementation does the request synchronously
+    virtual std::future<void> submit_readv(long offset, const iovec* iov, int iovcnt);
+    virtual std::future<void> submit_writev(long offset, const iovec* iov, int iovcnt);
+    virtual void sync() = 0; // a barrier: everything written before is durable when it returns
+    // device contents if they are directly addressable, nullptr otherwise
+    virtual char* mapping();
+    virtual DeviceStats stats() const;
+};
+
+// returns nullptr if the device cannot be opened. Requests to the device are counted (see stats())
+std::unique_ptr<Device> open_device(const std::string& filename, DeviceMode mode);
+} // END OF NAMESPACE myfs
+
+#endif
@@ -1,9 +1,25 @@
 #include "fs.h"
+#include "device.h"
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
 #include <cstring>
-#include <fstream>
+#include <future>
+#include <iterator>
+#include <limits>
+#include <list>
+#include <map>
+#include <mutex>
+#include <queue>
+#include <set>
+#include <shared_mutex>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 
 using namespace std;
 
@@ -14,667 +30,4811 @@ struct Link {
     char filename[FILENAME_MAX_LENGTH + 1];
 };
 
+// Run of consecutive device blocks holding consecutive blocks of a file
+struct Extent final {
+    int file_block; // index of the first block inside of the file
+    long start; // first device block
+    int length;
+};
+
+// Sequential access detection of one reader (a file or a descriptor). A read which starts where the
+// previous one ended doubles the window of data read ahead into the block cache, any other read
+// halves it. The next window is read when the reader gets past the middle of the current one.
+struct Readahead final {
+    // range of the file to read ahead along with the read of [shift, shift + size), false if none
+    bool advance(long shift, int size, long file_size, long max_window, long* start, long* end);
+private:
+    mutex lock;
+    long next_offset = 0; // where a sequential read starts
+    long ahead_end = 0; // end of the data read ahead
+    long window = 0; // bytes, 0 for random access
+};
+
+// Inode as it is kept in RAM
+struct INode final {
+    FileType type;
+    int n_links;
+    long size;
+    vector<Extent> extents; // sorted by file_block, holes (ZERO_BLOCKs) are not mapped
+    vector<int> extent_blocks; // overflow chain, sized by inode_fit_extent_blocks()
+    vector<char> inline_data; // whole data of a small file (Impl::inline_size bytes, zeros past size), empty if it has blocks
+    mutable shared_mutex lock; // held shared by readers of the fields and the data, exclusively by writers
+    mutable Readahead readahead; // of the File objects reading the file
+};
+
 // INTERNAL LINKAGE SECTION
 namespace {
 
-struct INode final {
+// On-disk structures take a whole block, their arrays are sized for the largest block size.
+// How much of them fits into the block of a particular image is kept in Filesystem::Impl.
+constexpr int LEGACY_BLOCK_SIZE = 512; // images without a superblock
+constexpr int LEGACY_BLOCKS_PER_INODE = (LEGACY_BLOCK_SIZE - 3 * sizeof(int)) / sizeof(int);
+
+// Extents and file sizes are stored with 64 bits on images of superblock version 2 and later (the wide
+// layout), with 32 bits on the older ones (the narrow layout). Nothing else differs: inode blocks and
+// their overflow chains are kept in the first 2^31 blocks (see allocate_block), so inode ids take
+// 32 bits on every image.
+struct NarrowExtent final {
+    int file_block;
+    int start;
+    int length;
+};
+
+struct WideExtent final {
+    int64_t start;
+    int file_block;
+    int length;
+};
+
+// Inode as it is stored on the device. Extents which don't fit into the inode block
+// are stored in a chain of ExtentBlocks. Data of small regular files and symlinks is kept
+// right in the inode block instead of the extents (INODE_INLINE is set then).
+template <typename Size, typename DiskExtent>
+struct DiskINode final {
+    static constexpr int HEADER_SIZE = 4 * sizeof(int) + sizeof(Size);
+    static constexpr int EXTENTS = (MAX_BLOCK_SIZE - HEADER_SIZE) / sizeof(DiskExtent);
+    int type; // FileType | INODE_MAGIC | INODE_INLINE
+    int n_links;
+    Size size;
+    int n_extents;
+    int extent_block; // first overflow block, ZERO_BLOCK if none
+    union {
+        DiskExtent extents[EXTENTS];
+        char data[EXTENTS * sizeof(DiskExtent)];
+    };
+};
+
+template <typename DiskExtent>
+struct ExtentBlock final {
+    static constexpr int HEADER_SIZE = 2 * sizeof(int);
+    static constexpr int EXTENTS = (MAX_BLOCK_SIZE - HEADER_SIZE) / sizeof(DiskExtent);
+    int next; // ZERO_BLOCK for the last block in the chain
+    int count;
+    DiskExtent extents[EXTENTS];
+};
+
+using NarrowINode = DiskINode<int, NarrowExtent>;
+using WideINode = DiskINode<int64_t, WideExtent>;
+
+// Inode layout of images formatted before extents were introduced, converted on load
+struct LegacyINode final {
     FileType type;
     int n_links;
     int size;
-    int data_block_ids[BLOCKS_PER_INODE];
-    // todo add link to additional data_blocks
+    int data_block_ids[LEGACY_BLOCKS_PER_INODE];
+};
+
+// Directories are B+ trees keyed by filename hash (htree-like). Every node takes one block
+// of the directory file, the root is the first one. Flat arrays of Links (the old format)
+// are still readable and get converted on the first modification.
+struct DirNodeHeader final {
+    int magic; // distinguishes indexed directories from flat ones (which start with Link)
+    int depth; // 0 for leaves
+    int count;
+    int n_files; // root only: number of links in the whole directory
+};
+
+struct DirIndexEntry final {
+    uint32_t hash; // all names in the subtree have hash >= this one
+    int block_index; // index of the block inside of the directory file
+};
+
+constexpr int LINKS_PER_DIR_LEAF = (MAX_BLOCK_SIZE - sizeof(DirNodeHeader)) / sizeof(Link);
+constexpr int ENTRIES_PER_DIR_INDEX = (MAX_BLOCK_SIZE - sizeof(DirNodeHeader)) / sizeof(DirIndexEntry);
+
+struct DirNode final {
+    DirNodeHeader header;
+    union {
+        Link links[LINKS_PER_DIR_LEAF];
+        DirIndexEntry entries[ENTRIES_PER_DIR_INDEX];
+    };
 };
 
-static_assert(sizeof(INode) != BLOCK_SIZE, "INode size != BLOCK_SIZE");
+enum class DirInsertResult { Done, Split, Failed };
+
+static_assert(sizeof(DirNode) <= MAX_BLOCK_SIZE, "DirNode size > MAX_BLOCK_SIZE");
+static_assert(sizeof(NarrowINode) <= MAX_BLOCK_SIZE && sizeof(WideINode) <= MAX_BLOCK_SIZE, "DiskINode size > MAX_BLOCK_SIZE");
+static_assert(offsetof(NarrowINode, extents) == NarrowINode::HEADER_SIZE
+              && offsetof(WideINode, extents) == WideINode::HEADER_SIZE, "unexpected DiskINode layout");
+static_assert(sizeof(ExtentBlock<WideExtent>) <= MAX_BLOCK_SIZE, "ExtentBlock size > MAX_BLOCK_SIZE");
+static_assert(offsetof(ExtentBlock<NarrowExtent>, extents) == ExtentBlock<NarrowExtent>::HEADER_SIZE
+              && offsetof(ExtentBlock<WideExtent>, extents) == ExtentBlock<WideExtent>::HEADER_SIZE,
+              "unexpected ExtentBlock layout");
+static_assert(sizeof(LegacyINode) <= LEGACY_BLOCK_SIZE, "LegacyINode size > LEGACY_BLOCK_SIZE");
 constexpr int ZERO_BLOCK = -1;
 constexpr int BAD_BLOCK = -2;
+constexpr int DIR_NODE_MAGIC = -0x44495258;
+constexpr int INODE_MAGIC = 0x45580000;
+constexpr int INODE_MAGIC_MASK = ~0xffff;
+constexpr int INODE_TYPE_MASK = 0xff;
+constexpr int INODE_INLINE = 0x100;
+constexpr int CACHE_PAGES = 1024;
+constexpr long READAHEAD_MIN_SIZE = 16 * 1024; // first window of a sequential reader
+constexpr long READAHEAD_MAX_SIZE = 256 * 1024; // and at most a quarter of the block cache
+constexpr int READAHEAD_MAX_READ = 64 * 1024; // larger reads are efficient requests by themselves
+constexpr int INODE_CACHE_SIZE = 256; // unreferenced inodes kept in RAM
+constexpr int DENTRY_CACHE_SIZE = 4096;
+constexpr int BITS_PER_WORD = 64;
+constexpr int RUN_SEARCH_LIMIT = 64; // free runs looked at by one contiguous allocation
+constexpr int WHOLE_BLOCK = -1; // size argument of the block functions
+constexpr int FORMAT_CHUNK_BLOCKS = 256; // bitmask blocks zeroed by one request of format()
+constexpr long MAX_PIECE = 1L << 30; // bytes moved by one internal read or write (see in_pieces)
+
+static_assert(MIN_BLOCK_SIZE * 8 % BITS_PER_WORD == 0, "bitmask block must consist of whole words");
+
+constexpr uint64_t SUPERBLOCK_MAGIC = 0x525055535346594dull; // "MYFSSUPR"
+constexpr int SUPERBLOCK_VERSION = 3; // the wide layout with shared blocks (see Refcounts)
+constexpr int UNSHARED_SUPERBLOCK_VERSION = 2; // the wide layout, upgraded when a block gets shared
+constexpr int NARROW_SUPERBLOCK_VERSION = 1;
+
+// The first block of images formatted with a superblock, the bitmask follows it. Images
+// without one (formatted before it was introduced) have 512-byte blocks, the narrow layout and the
+// bitmask right at the beginning, their geometry is derived from the device size.
+struct SuperBlock final {
+    uint64_t magic;
+    int version;
+    int block_size;
+    int64_t n_blocks; // whole image, including the superblock
+    int64_t n_bitmask_blocks;
+    int64_t n_data_blocks; // described by the bitmask, the root inode is the first one
+    int64_t root_inode;
+    int64_t refcount_head; // first refcount block, 0 if no block is shared (and on older images)
+    int64_t dedup_head; // first block of the fingerprint index saved by umount, 0 if there's none
+};
+
+// Superblock of version 1 images, read only
+struct NarrowSuperBlock final {
+    uint64_t magic;
+    int version;
+    int block_size;
+    int n_blocks;
+    int n_bitmask_blocks;
+    int n_data_blocks;
+    int root_inode;
+};
+
+constexpr uint64_t JOURNAL_MAGIC = 0x4c4e524a5346594dull; // "MYFSJRNL"
+constexpr uint32_t JOURNAL_DESCRIPTOR_MAGIC = 0x4a444553;
+constexpr uint32_t JOURNAL_COMMIT_MAGIC = 0x4a434d54;
+constexpr int JOURNAL_SHARE = 64; // the journal takes 1/64 of the device...
+constexpr int JOURNAL_MIN_BLOCKS = 16; // ...smaller journals aren't created
+constexpr int JOURNAL_MAX_BLOCKS = 2048;
+constexpr auto JOURNAL_COMMIT_INTERVAL = chrono::seconds{5};
+
+// The journal region starts right after the root inode with this block
+struct JournalHeader final {
+    uint64_t magic;
+    int n_blocks; // including the header
+    uint32_t sequence; // of the first transaction in the log
+};
+
+// A transaction in the log consists of the descriptor (followed by the ids of the logged
+// and of the revoked blocks, in the width of the image layout, possibly in several blocks), the contents of the logged blocks
+// and the commit block. Transactions follow each other with increasing sequence numbers.
+struct JournalDescriptor final {
+    uint32_t magic;
+    uint32_t sequence;
+    int n_blocks;
+    int n_revoked; // freed blocks whose older copies in the log must not be replayed
+};
+
+struct JournalCommit final {
+    uint32_t magic;
+    uint32_t sequence;
+    uint32_t checksum; // of the descriptor and the logged blocks
+};
+
+constexpr uint32_t REFCOUNT_MAGIC = 0x52454643; // "REFC"
+
+// Refcount block, the counts of its group of blocks follow the header
+struct RefcountBlockHeader final {
+    uint32_t magic;
+    int n_shared; // nonzero counts
+    int64_t group;
+    int64_t next; // refcount block of the next group, 0 for the last one
+};
+
+constexpr uint32_t DEDUP_MAGIC = 0x50554444; // "DDUP"
+
+// Block of the fingerprint index saved by umount, the entries follow the header
+struct DedupBlockHeader final {
+    uint32_t magic;
+    int n_entries;
+    int64_t next; // 0 for the last block
+};
+
+struct DedupEntry final {
+    uint64_t fingerprint;
+    int64_t block_id;
+};
+
+// In-RAM copy of the bitmask blocks. Bit i describes block (first_data_block + i).
+// Free bits are found through a summary tree: a bit per word of the bitmask which is set for full words,
+// then a bit per word of that level and so on up to a single word, so a search takes O(log n) steps
+// however large the device is. Changes are written back lazily (see flush()), only dirty bitmask blocks
+// are written. Not synchronized, guarded by Filesystem::Impl::allocator_lock.
+struct Bitmap final {
+    void load(Filesystem::Impl& fs);
+    void flush(Filesystem::Impl& fs);
+    void reset();
+    bool test(long bit) const;
+    void set(long bit);
+    void set_run(long bit, int length);
+    void unset(long bit);
+    long find_unset(); // returns -1 if there are no free bits
+    long find_unset_run(long goal, int length, int* run_length);
+private:
+    uint64_t word_used(size_t word_idx) const; // the word with the bits past the end of the device set
+    void update_summary(size_t word_idx);
+    long next_free_word(size_t word_idx) const;
+    long next_unset(long from) const;
+    int unset_run_length(long bit, int max_length) const;
+    vector<uint64_t> words;
+    vector<vector<uint64_t>> summary; // summary[0] describes words, summary[k + 1] describes summary[k]
+    vector<bool> dirty; // per bitmask block
+    long n_bits = 0;
+    int words_per_block = 0; // words of one bitmask block
+    long next_free_hint = 0; // there are no free bits before this one
+};
+
+// Extra references of the data blocks which are shared by several files (see Filesystem::clone), a
+// block which isn't shared has none. The counts are kept in refcount blocks, one per group of
+// consecutive blocks, which are allocated when a block of the group gets shared and freed when none
+// of them is shared any more. The refcount blocks are chained in the order of their groups from
+// the superblock, only images with the wide layout have them. Changes are written back like the
+// bitmask (see flush()). Not synchronized, guarded by Filesystem::Impl::allocator_lock.
+struct Refcounts final {
+    bool load(Filesystem::Impl& fs); // false if the chain is broken
+    void flush(Filesystem::Impl& fs);
+    void reset();
+    uint32_t get(long block_id) const;
+    bool increment(Filesystem::Impl& fs, long block_id); // false if a refcount block couldn't be allocated
+    void decrement(Filesystem::Impl& fs, long block_id);
+    bool empty() const;
+    long head() const; // refcount block of the first group, 0 if none
+private:
+    struct Group final {
+        long block_id; // the refcount block
+        vector<uint32_t> counts;
+        int n_shared;
+        bool dirty;
+    };
+    long group_of(long block_id) const;
+    void mark_previous_dirty(map<long, Group>::iterator it); // its next link changed
+    map<long, Group> groups; // by group index
+    int counts_per_block = 0;
+    long first_block = 0; // covered by the first group
+    bool head_dirty = false; // the superblock has to be written
+};
+
+// Fingerprints of full data blocks of regular files, one block per fingerprint (see Filesystem::dedup).
+// A match is only a hint, the contents are compared before the block gets shared. Not synchronized,
+// guarded by Filesystem::Impl::dedup_lock.
+struct DedupIndex final {
+    long find(uint64_t fingerprint) const; // BAD_BLOCK if no block has it
+    void insert(uint64_t fingerprint, long block_id); // a block which has the fingerprint already stays
+    void erase(long block_id);
+    vector<DedupEntry> entries() const;
+    void reset();
+private:
+    unordered_map<uint64_t, long> blocks; // by fingerprint
+    unordered_map<long, uint64_t> fingerprints; // by block
+};
+
+// Asynchronous device requests of one operation. They are waited for before leaving the scope even
+// when the operation fails, so that their buffers outlive them.
+struct PendingRequests final {
+    PendingRequests() = default;
+    PendingRequests(const PendingRequests&) = delete;
+    PendingRequests& operator=(const PendingRequests&) = delete;
+    ~PendingRequests();
+    void add(future<void> request);
+    bool empty() const;
+    void wait(); // throws DeviceError if any of the requests failed
+private:
+    vector<future<void>> requests;
+};
+
+// Write-back cache of device blocks with CLOCK eviction.
+// Dirty pages reach the device on eviction, flush() (sync/umount) only.
+// Every public method takes the cache lock, pages never leave the cache.
+struct BlockCache final {
+    void init(Device* device, int n_pages, int block_size);
+    void reset();
+    void read(long block_id, char* data, int size, int shift);
+    void write(long block_id, const char* data, int size, int shift);
+    bool read_cached(long block_id, char* data); // whole block, false if the block isn't cached
+    bool write_cached(long block_id, const char* data);
+    void fill(long block_id, int n_blocks, const char* data); // clean blocks read ahead, cached ones are kept
+    const char* pin(long block_id, int* page_index); // the page isn't evicted until unpin(page_index)
+    void unpin(int page_index);
+    void flush();
+    CacheStats stats();
+private:
+    struct Page final {
+        long block_id;
+        bool dirty;
+        bool referenced;
+        int pins;
+    };
+    char* page(long block_id, bool overwrite); // overwrite == true: don't load the old content on miss
+    char* find(long block_id); // nullptr if the block isn't cached
+    void mark_dirty(long block_id);
+    int evict();
+    void write_back(Page& page, int page_index);
+    Device* device = nullptr;
+    int block_size = 0;
+    mutex lock;
+    vector<char> data;
+    vector<Page> pages;
+    unordered_map<long, int> index; // block id -> page index
+    int clock_hand = 0;
+    CacheStats counters;
+};
+
+// Inodes kept in RAM, keyed by inode block id. Pinned entries (see pin/unpin) are never evicted,
+// so references to them stay valid. Unreferenced entries are kept in LRU order up to INODE_CACHE_SIZE.
+// Dirty inodes are written back on eviction and flush() (sync/umount).
+struct INodeCache final {
+    explicit INodeCache(Filesystem::Impl& fs);
+    INode& pin(int block_id);
+    INode& pinned(int block_id); // inode which is already pinned by the caller
+    INode& add(int block_id); // pinned inode for a just allocated block
+    INode* unpin(int block_id); // returns the inode if it has to be freed (no links and references left)
+    void mark_dirty(int block_id);
+    void erase(int block_id); // inode block was freed, drop without writing back
+    void flush();
+    void reset();
+private:
+    struct Entry final {
+        INode inode;
+        int refs;
+        bool dirty;
+        list<int>::iterator lru_pos; // valid only when refs == 0
+    };
+    Entry& insert(int block_id);
+    void shrink();
+    Filesystem::Impl& fs;
+    mutex lock;
+    unordered_map<int, Entry> entries;
+    list<int> lru; // unreferenced entries, least recently used first
+};
+
+// Results of directory lookups: (directory inode, filename) -> inode, BAD_BLOCK for missing files.
+// Must be updated by everything which adds or removes links. Keeps DENTRY_CACHE_SIZE entries in LRU order.
+struct DentryCache final {
+    bool find(int dir_inode_id, const char* name, size_t length, int* inode_id) const;
+    void insert(int dir_inode_id, const char* name, size_t length, int inode_id);
+    void erase_dir(int dir_inode_id); // directory inode was freed
+    void reset();
+private:
+    struct Key final {
+        Key(int dir_inode_id, const char* name, size_t length);
+        bool operator==(const Key& other) const;
+        int dir_inode_id;
+        char name[FILENAME_MAX_LENGTH + 1];
+    };
+    struct KeyHash final {
+        size_t operator()(const Key& key) const;
+    };
+    struct Entry final {
+        int inode_id;
+        list<Key>::iterator lru_pos;
+    };
+    mutable mutex lock;
+    unordered_map<Key, Entry, KeyHash> entries;
+    mutable list<Key> lru; // least recently used first
+};
 
-auto root_inode_id = -1;
-auto device_capacity = -1l;
-auto n_bitmask_blocks = -1;
-auto n_data_blocks = -1;
-string cwd = ROOTDIR_NAME;
-fstream fio;
-
-bool is_mounted();
-int div_ceil(int a, int b);
-void read_block(int block_id, char* data, int size = BLOCK_SIZE, int shift = 0);
-void read_block(int block_id, INode* inode);
-void write_block(int block_id, const char* data, int size = BLOCK_SIZE, int shift = 0);
-void write_block(int block_id, const INode* inode);
-void block_mark_used(int block_id);
-void block_mark_unused(int block_id);
-bool block_used(int block_id);
-int find_empty_block();
-int find_inode_block_id(const string& path);
-string get_file_directory(const string& path);
+// Open file descriptor (see Filesystem::open), keeps its inode pinned until it's closed
+struct Descriptor final {
+    Descriptor(int inode_id, INode& inode);
+    const int inode_id;
+    INode& inode;
+    mutex lock; // taken before any other lock, serializes the operations moving the position
+    long offset = 0;
+    Readahead readahead;
+    bool closed = false;
+};
+
+// Descriptors by number, the lowest free number is reused first like in POSIX
+struct DescriptorTable final {
+    int add(shared_ptr<Descriptor> descriptor);
+    shared_ptr<Descriptor> find(int fd) const; // nullptr for unknown descriptors
+    shared_ptr<Descriptor> remove(int fd);
+    void reset();
+private:
+    mutable mutex lock;
+    vector<shared_ptr<Descriptor>> descriptors; // nullptr for free numbers
+    priority_queue<int, vector<int>, greater<int>> free_fds;
+};
+
+// Write-ahead log of metadata blocks (bitmask, inode, extent and directory blocks).
+// Metadata writes of the running transaction are kept here and reach their home locations
+// only after the whole transaction is in the log. Logged blocks stay in the log until the next
+// sync() makes their home copies durable. Fields are guarded by lock.
+struct Journal final {
+    void reset();
+    int start = -1; // header block, -1 for images without journal
+    int n_blocks = 0; // including the header
+    int head = -1; // next block of the log
+    uint32_t sequence = 0; // of the running transaction
+    bool active = false; // the running transaction has changes
+    chrono::steady_clock::time_point opened; // when the running transaction got its first change
+    map<long, vector<char>> blocks; // running transaction: block id -> new contents
+    vector<long> revoked; // blocks freed by the running transaction which are in the log already
+    set<long> freed; // blocks freed by the running transaction, whatever is written to them is journaled
+    unordered_set<long> logged; // blocks in the log
+    mutex lock;
+};
+
+// Public operations timed by Instrumentation
+enum class Call { Mount, Mkfs, Umount, Sync, Ls, Create, Link, Unlink, FileExists, Mkdir, Rmdir, Cd, Symlink,
+                  Clone, Dedup, Open, Filestat, Read, Cat, View, Write, Append, Seek, Truncate, Close, Count };
+const char* const CALL_NAMES[] = {"mount", "mkfs", "umount", "sync", "ls", "create", "link", "unlink", "file_exists",
+                                  "mkdir", "rmdir", "cd", "symlink", "clone", "dedup", "open", "filestat", "read", "cat", "view", "write",
+                                  "append", "seek", "truncate", "close"};
+
+// Lock-free version of LatencyStats. All the accesses are relaxed: the counters are independent and
+// are only read as a snapshot, so timed operations pay no fences.
+struct Histogram final {
+    void add(long ns);
+    LatencyStats snapshot() const;
+    void reset();
+private:
+    atomic<long> count{0};
+    atomic<long> total_ns{0};
+    atomic<long> max_ns{0};
+    atomic<long> buckets[LATENCY_BUCKETS]{};
+};
+
+// Counters behind Filesystem::stats(). While disabled every update is one relaxed atomic load.
+struct Instrumentation final {
+    bool enabled() const;
+    void add(atomic<long>& counter, long n);
+    Stats snapshot() const;
+    void reset();
+    atomic<bool> on{false};
+    Histogram block_reads;
+    Histogram block_writes;
+    atomic<long> blocks_read{0};
+    atomic<long> blocks_written{0};
+    Histogram bitmap_scans;
+    Histogram dir_scans;
+    atomic<long> dir_entries_scanned{0};
+    Histogram calls[static_cast<int>(Call::Count)];
+};
+
+// Adds its lifetime to a histogram if statistics are enabled
+struct Timer final {
+    Timer(const Instrumentation& stats, Histogram& histogram);
+    Timer(Instrumentation& stats, Call call);
+    Timer(const Timer&) = delete;
+    Timer& operator=(const Timer&) = delete;
+    ~Timer();
+private:
+    Histogram* histogram; // nullptr if disabled
+    chrono::steady_clock::time_point start;
+};
+
+// Keeps an inode pinned in the cache for the lifetime of the object
+struct INodeRef final {
+    INodeRef(Filesystem::Impl& fs, int inode_id);
+    INodeRef(const INodeRef&) = delete;
+    INodeRef& operator=(const INodeRef&) = delete;
+    ~INodeRef();
+    INode& operator*() const;
+    INode* operator->() const;
+    int id() const;
+private:
+    Filesystem::Impl& fs;
+    const int inode_id;
+    INode& inode;
+};
+
+// Read-only view of a whole block without copying it: into the device mapping or into a block cache
+// page, which stays pinned while the view lives. Blocks of the running transaction may be dropped
+// by a commit at any time, they are copied. The caller must keep the block from being written.
+struct BlockView final {
+    BlockView(Filesystem::Impl& fs, long block_id);
+    BlockView(const BlockView&) = delete;
+    BlockView& operator=(const BlockView&) = delete;
+    ~BlockView();
+    const char* data() const;
+    template <typename T>
+    const T& as() const;
+private:
+    Filesystem::Impl& fs;
+    const char* block;
+    int page_index = -1; // pinned cache page
+    unique_ptr<char[]> block_copy;
+};
+
+long div_ceil(long a, long b);
+uint32_t checksum(const char* data, size_t size, uint32_t hash = 2166136261u);
+uint64_t fingerprint(const char* data, int size);
+long get_block_id(const char* ids, int index, bool wide);
+void put_block_id(char* ids, int index, long block_id, bool wide);
+template <typename DiskExtent>
+Extent from_disk(const DiskExtent& extent);
+template <typename DiskExtent>
+DiskExtent to_disk(const Extent& extent);
+long inode_block(const INode& inode, int file_block);
+long inode_run(const INode& inode, int file_block, int* n_blocks);
+void inode_map(INode& inode, int file_block, long start, int length);
+bool is_zero(const char* data, int size);
+template <typename Transfer>
+bool in_pieces(long size, Transfer transfer);
 string get_filename(const string& path);
-int dir_find_file_inode(const File& dir, const string& filename);
-int inode_follow_symlinks(int inode_block_id, int max_follows = MAX_SYMLINK_FOLLOWS);
-void dereference_inode(int inode_id);
+uint32_t filename_hash(const char* filename);
+int dir_index_child(const DirNode& node, uint32_t hash);
 string join_path(string part1, string part2);
+} // END OF INTERNAL LINKAGE SECTION
 
-bool is_mounted() {
-    return device_capacity != -1 && fio.is_open();
-}
+// Everything a mounted image consists of. Directory contents and link counts are guarded by
+// namespace_lock (taken by the public operations), file contents and inode fields by INode::lock.
+// Operations which change metadata run inside of transaction() and are excluded by commits.
+// Locks are taken in this order: descriptor locks, commit_lock, namespace_lock, inode locks, dedup_lock,
+// allocator_lock or the inode cache lock, the journal lock, the block cache lock. The dentry cache
+// and readahead locks are never held while taking another one.
+struct Filesystem::Impl final {
+    bool is_mounted() const;
+    bool mount(const string& filename, DeviceMode mode, bool enable_dedup);
+    bool mkfs(const string& filename, int block_size, DeviceMode mode);
+    void umount();
+    void sync();
+    void set_geometry(int block_size, long n_blocks, bool has_superblock, bool wide_layout);
+    template <typename Size, typename DiskExtent>
+    void use_layout();
+    template <int BlockSize>
+    void use_block_size();
+    bool format(int block_size);
+    SuperBlock superblock() const;
+    int n_extent_blocks(size_t n_extents) const;
+    int open_inode(const string& path, bool follow_symlink); // returns pinned inode
+    int open_inode(int inode_id, bool follow_symlink);
+    int pin_inode(int inode_id, bool follow_symlink); // namespace_lock must be held
+    string cwd();
+    void set_cwd(const string& path);
+    template <typename Operation>
+    void transaction(Operation operation);
 
-int div_ceil(int a, int b) {
-    return a == 0 ? 0 : (a - 1) / b + 1;
-}
+    void read_block(long block_id, char* data, int size = WHOLE_BLOCK, int shift = 0);
+    void read_blocks(long block_id, int n_blocks, char* data, PendingRequests* pending = nullptr);
+    void read_inode(int block_id, INode* inode);
+    template <typename Size, typename DiskExtent>
+    void read_inode_as(int block_id, INode* inode);
+    void write_block(long block_id, const char* data, int size = WHOLE_BLOCK, int shift = 0);
+    void write_blocks(long block_id, int n_blocks, const char* data, PendingRequests* pending = nullptr);
+    void write_inode(int block_id, const INode& inode);
+    template <typename Size, typename DiskExtent>
+    void write_inode_as(int block_id, const INode& inode);
+    void read_metadata_block(long block_id, char* data, int size = WHOLE_BLOCK, int shift = 0);
+    void write_metadata_block(long block_id, const char* data, int size = WHOLE_BLOCK, int shift = 0);
+    void read_file_block(const INode& inode, long block_id, char* data, int size = WHOLE_BLOCK, int shift = 0);
+    void write_file_block(const INode& inode, long block_id, const char* data, int size = WHOLE_BLOCK, int shift = 0);
 
-void read_block(int block_id, char* data, int size, int shift) {
-    assert(is_mounted());
-    assert(0 <= block_id && block_id < n_data_blocks + n_bitmask_blocks);
-    assert(0 <= size);
-    assert(0 <= shift);
-    assert(size + shift <= BLOCK_SIZE);
-    fio.seekg(block_id * BLOCK_SIZE + shift, fio.beg);
-    fio.read(data, size);
-    assert(fio.gcount() == size);
-#ifndef NDEBUG
-    fio.flush();
-#endif
-}
+    bool journal_load();
+    void journal_format();
+    void journal_replay();
+    bool journal_holds(long block_id, int n_blocks);
+    bool journal_join();
+    void journal_commit();
+    void journal_forget(long start, int length);
+    void journal_reset();
+    void journal_write_header();
 
-void read_block(int block_id, INode* inode) {
-    read_block(block_id, reinterpret_cast<char*>(inode));
-}
+    void free_blocks(long start, int length);
+    bool share_blocks(long start, int length); // adds a reference to each data block, false if the device is full
+    void release_blocks(long start, int length); // drops one, blocks which aren't shared any more are freed
+    int shared_run(long start, int length, bool* shared); // length of the leading run of blocks which are all shared or all not
+    void dedup_load(long head);
+    void dedup_save();
+    bool dedup_block(INode& inode, int inode_id, int file_block, const char* data, uint64_t fingerprint, DedupIndex& index);
+    long dedup_file(INode& inode, int inode_id, DedupIndex& index);
+    void block_mark_used(long block_id);
+    bool block_used(long block_id);
+    int allocate_block();
+    long allocate_blocks(long goal_block, int n_blocks, int* n_allocated);
+    void inode_unmap(INode& inode, int first_file_block, int n_blocks);
+    bool inode_fit_extent_blocks(INode& inode);
+    int inode_allocate(INode& inode, int inode_id, int first_file_block, int end_file_block);
+    bool inode_uninline(INode& inode, int inode_id);
+    bool inode_unshare(INode& inode, int inode_id, long from, long to);
+    bool inode_reserve_extent_blocks(INode& inode, size_t n_extents);
 
-void write_block(int block_id, const char* data, int size, int shift) {
-    assert(is_mounted());
-    assert(0 <= block_id && block_id < n_data_blocks + n_bitmask_blocks);
-    assert(0 <= size);
-    assert(0 <= shift);
-    assert(size + shift <= BLOCK_SIZE);
-    fio.seekp(block_id * BLOCK_SIZE + shift, fio.beg);
-    fio.write(data, size);
-#ifndef NDEBUG
-    fio.flush();
-#endif
-}
+    // contents of files, the caller holds the inode lock
+    void file_read(const INode& inode, char* data, int size, long shift, Readahead* readahead = nullptr);
+    template <typename Visit>
+    void file_view(const INode& inode, int size, long shift, Visit visit);
+    string file_cat(const INode& inode);
+    bool file_write(INode& inode, int inode_id, const char* data, int size, long shift);
+    bool file_write_at(INode& inode, int inode_id, const char* data, int size, long shift); // grows the file
+    bool file_write_deduped(INode& inode, int inode_id, const char* data, int size, long shift);
+    template <int BlockSize>
+    void file_read_blocks(const INode& inode, char* data, int size, long shift);
+    template <int BlockSize>
+    bool file_write_blocks(INode& inode, int inode_id, const char* data, int size, long shift);
+    bool file_append(INode& inode, int inode_id, const char* data, int size);
+    bool file_truncate(INode& inode, int inode_id, long size);
+    string file_stat(const INode& inode, int inode_id);
+    long file_seek(const INode& inode, long offset, bool data);
 
-void write_block(int block_id, const INode* inode) {
-    write_block(block_id, reinterpret_cast<const char*>(inode));
-}
+    // the rest is called with namespace_lock held
+    int find_inode_block_id(const string& path);
+    string get_file_directory(const string& path);
+    int dir_lookup(int dir_inode_id, const char* name, size_t length);
+    int dir_find_file_inode(const INode& dir, const string& filename);
+    bool dir_is_indexed(const INode& dir);
+    bool dir_convert(INodeRef& dir);
+    void dir_read_node(const INode& dir, int node_index, DirNode* node);
+    bool dir_write_node(INodeRef& dir, int node_index, const DirNode& node);
+    int dir_append_node(INodeRef& dir, const DirNode& node);
+    int dir_find_leaf(const INode& dir, uint32_t hash, DirNode* leaf);
+    DirInsertResult dir_node_insert(INodeRef& dir, int node_index, uint32_t hash, const Link& lnk, DirIndexEntry* split);
+    bool dir_add_link(INodeRef& dir, const Link& lnk);
+    int dir_remove_link(INodeRef& dir, const string& filename);
+    vector<Link> dir_links(const INode& dir);
+    template <typename Visit>
+    void dir_for_each_link(const INode& dir, Visit visit);
+    int dir_n_files(const INode& dir);
+    int inode_follow_symlinks(int inode_block_id, int max_follows = MAX_SYMLINK_FOLLOWS);
+    void dereference_inode(int inode_id);
+    void release_inode(int inode_id);
+    void free_inode(int inode_id, const INode& inode);
 
-void block_mark_used(int block_id) {
-    assert(block_id >= n_bitmask_blocks);
-    assert(is_mounted());
-    fio.seekg((block_id - n_bitmask_blocks) / 8, fio.beg);
-    auto old_mask = fio.get();
-    assert(old_mask >= 0);
-    fio.seekp((block_id - n_bitmask_blocks) / 8, fio.beg);
-    fio.put(static_cast<char>(old_mask | (1 << ((block_id - n_bitmask_blocks) % 8))));
-#ifndef NDEBUG
-    fio.flush();
-#endif
-}
-
-void block_mark_unused(int block_id) {
-    assert(block_id >= n_bitmask_blocks);
-    assert(is_mounted());
-    fio.seekg((block_id - n_bitmask_blocks) / 8, fio.beg);
-    auto  old_mask = fio.get();
-    assert(old_mask >= 0);
-    fio.seekp((block_id - n_bitmask_blocks) / 8, fio.beg);
-    fio.put(static_cast<char>(old_mask & ~(1 << ((block_id - n_bitmask_blocks) % 8))));
-#ifndef NDEBUG
-    fio.flush();
-#endif
-}
-
-bool block_used(int block_id) {
-    assert(block_id >= n_bitmask_blocks);
-    assert(is_mounted());
-    fio.seekg((block_id - n_bitmask_blocks) / 8, fio.beg);
-    return (fio.get() & (1 << ((block_id - n_bitmask_blocks) % 8))) != 0;
-}
-
-int find_empty_block() {
-    for (int bitmask_block_id = 0; bitmask_block_id < n_bitmask_blocks; ++bitmask_block_id) {
-        char data[BLOCK_SIZE];
-        read_block(bitmask_block_id, data);
-        for (int idx = 0; idx < BLOCK_SIZE; ++idx) {
-            if (data[idx] != ~'\0') {
-                for (int n_bit = 0; n_bit < 8; ++n_bit) {
-                    if ((data[idx] & (1 << n_bit)) == 0) {
-                        int result = (bitmask_block_id * BLOCK_SIZE + idx) * 8 + n_bit;
-                        if (result >= n_data_blocks) {
-                            return BAD_BLOCK;
-                        }
-                        result = result + n_bitmask_blocks;
-                        assert(!block_used(result));
-                        return result;
-                    }
-                }
-                assert(false);
-            }
-        }
-    }
+    string ls(const string& dirname);
+    int create(const string& path, FileType type);
+    bool link(const string& target, const string& name_path);
+    bool unlink(const string& path);
+    bool rmdir(const string& dirname);
+    bool symlink(const string& target, const string& name);
+    bool clone(const string& source, const string& path);
+    long dedup_pass();
 
-    return BAD_BLOCK;
+    // geometry, see set_geometry()
+    int block_size = DEFAULT_BLOCK_SIZE;
+    bool wide = false; // 64-bit extents and file sizes (see WideExtent)
+    int root_inode_id = -1;
+    long device_capacity = -1;
+    long n_device_blocks = -1; // whole image
+    int bitmap_start = -1; // first bitmask block
+    int n_bitmask_blocks = -1;
+    int first_data_block = -1; // described by the first bit of the bitmask
+    long n_data_blocks = -1;
+    long max_file_size = 0; // what the inode size field and int file block indices can describe
+    int inode_extents = 0; // extents which fit into the inode block
+    int inline_size = 0; // bytes of inline data which fit into the inode block
+    int extents_per_block = 0;
+    int links_per_dir_leaf = 0;
+    int entries_per_dir_index = 0;
+    // file_read_blocks/file_write_blocks specialized on the block size, picked on mount
+    void (Impl::*file_read_sized)(const INode& inode, char* data, int size, long shift) = nullptr;
+    bool (Impl::*file_write_sized)(INode& inode, int inode_id, const char* data, int size, long shift) = nullptr;
+    unique_ptr<Device> device;
+    shared_mutex commit_lock; // shared by operations changing metadata, exclusive for commits
+    shared_mutex namespace_lock;
+    mutex allocator_lock;
+    Bitmap bitmap;
+    Refcounts refcounts; // empty on images with the narrow layout
+    bool dedup = false; // written blocks are looked up in dedup_index (see Filesystem::mount)
+    mutex dedup_lock;
+    DedupIndex dedup_index; // guarded by dedup_lock
+    long dedup_head = 0; // the index saved by umount (see dedup_save)
+    BlockCache cache;
+    INodeCache inodes{*this};
+    DentryCache dentries;
+    DescriptorTable descriptors;
+    Journal journal;
+    long generation = 0; // bumped by umount, so that Files of earlier mounts know they're stale
+    Instrumentation stats;
+    mutex cwd_lock;
+    unordered_map<thread::id, string> cwds; // threads which never called cd() are in the root
+};
+
+// INTERNAL LINKAGE SECTION
+namespace {
+
+long div_ceil(long a, long b) {
+    return a == 0 ? 0 : (a - 1) / b + 1;
 }
 
-int dir_find_file_inode(const File& dir, const string& filename) {
-    if (filename == ".") {
-        return dir.inode_id();
+uint32_t checksum(const char* data, size_t size, uint32_t hash) {
+    // FNV-1a
+    for (size_t i = 0; i < size; ++i) {
+        hash = (hash ^ static_cast<unsigned char>(data[i])) * 16777619u;
     }
-    auto data = dir.cat();
-    auto dir_size = data.size();
-    assert(data.size() % sizeof(Link) == 0);
+    return hash;
+}
 
-    for (int n_file = 0; n_file < dir_size / sizeof(Link); ++n_file) {
-        auto& lnk = *reinterpret_cast<const Link*>(data.data() + n_file * sizeof(Link));
-        if (lnk.filename == filename) {
-            return lnk.inode_block_id;
+// Hash of a whole block for the dedup index: four independent lanes of 64-bit multiply-xorshift
+// steps, so that the multiplications overlap, folded together at the end
+uint64_t fingerprint(const char* data, int size) {
+    constexpr uint64_t PRIME = 0x9e3779b97f4a7c15ull;
+    constexpr int LANES = 4;
+    assert(size % (LANES * sizeof(uint64_t)) == 0);
+    uint64_t lanes[LANES] = {PRIME, PRIME + 1, PRIME + 2, PRIME + 3};
+    for (int i = 0; i < size; i += LANES * sizeof(uint64_t)) {
+        for (int lane = 0; lane < LANES; ++lane) {
+            uint64_t word;
+            memcpy(&word, data + i + lane * sizeof(uint64_t), sizeof(word));
+            lanes[lane] = (lanes[lane] ^ word) * PRIME;
+            lanes[lane] ^= lanes[lane] >> 29;
         }
     }
-    return BAD_BLOCK;
+    uint64_t hash = static_cast<uint64_t>(size);
+    for (uint64_t lane : lanes) {
+        hash = (hash ^ lane) * PRIME;
+        hash ^= hash >> 32;
+    }
+    return hash;
 }
 
-string get_file_directory(const string& path) {
-    assert(path != ROOTDIR_NAME);
-    const auto sep_index = path.find_last_of(PATH_SEPARATOR);
-    if (sep_index == string::npos) {
-        return cwd;
-    } else {
-        auto dirname = path.substr(0, sep_index);
-        auto abs_dirname = dirname[0] == PATH_SEPARATOR ? dirname : join_path(cwd, dirname);
-        return abs_dirname;
+// block ids in the journal descriptors take 8 bytes on wide images, 4 on narrow ones
+long get_block_id(const char* ids, int index, bool wide) {
+    if (wide) {
+        int64_t block_id;
+        memcpy(&block_id, ids + index * sizeof(block_id), sizeof(block_id));
+        return block_id;
     }
+    int block_id;
+    memcpy(&block_id, ids + index * sizeof(block_id), sizeof(block_id));
+    return block_id;
 }
 
-string get_filename(const string& path) {
-    const auto sep_index = path.find_last_of(PATH_SEPARATOR);
-    if (sep_index == string::npos) {
-        return path;
+void put_block_id(char* ids, int index, long block_id, bool wide) {
+    if (wide) {
+        int64_t id = block_id;
+        memcpy(ids + index * sizeof(id), &id, sizeof(id));
     } else {
-        return path.substr(sep_index + 1);
+        assert(block_id <= numeric_limits<int>::max());
+        int id = static_cast<int>(block_id);
+        memcpy(ids + index * sizeof(id), &id, sizeof(id));
     }
 }
 
-int find_inode_block_id(const string& path) {
-    const string absolute_path = path[0] != PATH_SEPARATOR ? join_path(cwd, path) : path;
-    if (absolute_path == ROOTDIR_NAME) {
-        return root_inode_id;
-    }
-    int dir_inode = root_inode_id;
-    size_t start = 1;
-    while (true) {
-        auto sep_index = absolute_path.find(PATH_SEPARATOR, start);
-        if (sep_index == string::npos) {
-            auto filename = absolute_path.substr(start);
-            return dir_find_file_inode(File{dir_inode}, filename);
-        } else {
-            auto subdirname = absolute_path.substr(start, sep_index - start);
-            start = sep_index + 1;
-            if (subdirname == ".") continue;
-            dir_inode = dir_find_file_inode(File{dir_inode}, subdirname);
-            if (dir_inode == BAD_BLOCK) {
-                return BAD_BLOCK;
-            }
-        }
-    }
+template <typename DiskExtent>
+Extent from_disk(const DiskExtent& extent) {
+    return Extent{extent.file_block, extent.start, extent.length};
 }
 
-int inode_follow_symlinks(int inode_block_id, int max_follows) {
-    assert(max_follows >= 0);
-    assert(inode_block_id >= 0);
-    INode inode;
-    read_block(inode_block_id, &inode);
-    if (inode.type != FileType::Symlink) {
-        return inode_block_id;
-    } else {
-        if (max_follows == 0) {
-            assert(false && "Cyclic reference error");
-            return BAD_BLOCK;
-        }
-        File symlink{inode_block_id, false};
-        auto target_name = symlink.cat();
-        auto linked_inode_block_id = find_inode_block_id(target_name);
-        if (linked_inode_block_id == BAD_BLOCK) {
-            assert(false && "Symbolic link points to nothing");
-            return BAD_BLOCK;
+template <typename DiskExtent>
+DiskExtent to_disk(const Extent& extent) {
+    DiskExtent result;
+    result.file_block = extent.file_block;
+    result.start = static_cast<decltype(result.start)>(extent.start);
+    result.length = extent.length;
+    return result;
+}
+
+PendingRequests::~PendingRequests() {
+    for (auto& request : requests) {
+        if (request.valid()) {
+            request.wait();
         }
-        return inode_follow_symlinks(find_inode_block_id(target_name), max_follows - 1);
     }
 }
 
-void dereference_inode(int inode_id) {
-    INode inode;
-    read_block(inode_id, &inode);
+void PendingRequests::add(future<void> request) {
+    requests.push_back(move(request));
+}
+
+bool PendingRequests::empty() const {
+    return requests.empty();
+}
 
-    if (inode.n_links == 1) {
-        for (int block_index = 0; block_index * BLOCK_SIZE < inode.size; ++block_index) {
-            int block_id = inode.data_block_ids[block_index];
-            if (block_id != ZERO_BLOCK) {
-                block_mark_unused(block_id);
+void PendingRequests::wait() {
+    exception_ptr error;
+    for (auto& request : requests) {
+        try {
+            request.get();
+        } catch (const DeviceError&) {
+            if (error == nullptr) {
+                error = current_exception();
             }
         }
-        block_mark_unused(inode_id);
-    } else {
-        --inode.n_links;
-        write_block(inode_id, &inode);
+    }
+    requests.clear();
+    if (error != nullptr) {
+        rethrow_exception(error);
     }
 }
 
-string join_path(string part1, string part2) {
-    if (part1 == ROOTDIR_NAME) {
-        return PATH_SEPARATOR + part2;
-    }
-    return part1 + PATH_SEPARATOR + part2;
+void BlockCache::init(Device* device, int n_pages, int block_size) {
+    lock_guard<mutex> guard{lock};
+    this->device = device;
+    this->block_size = block_size;
+    data.assign(static_cast<size_t>(n_pages) * block_size, '\0');
+    pages.assign(static_cast<size_t>(n_pages), Page{BAD_BLOCK, false, false, 0});
+    index.clear();
+    index.reserve(static_cast<size_t>(n_pages));
+    clock_hand = 0;
+    counters = CacheStats{};
 }
-} // END OF INTERNAL LINKAGE SECTION
 
+void BlockCache::reset() {
+    lock_guard<mutex> guard{lock};
+    device = nullptr;
+    data.clear();
+    pages.clear();
+    index.clear();
+    clock_hand = 0;
+}
 
-bool mount(const string& filename) {
-    umount();
-    fio.open(filename, fstream::in | fstream::binary | fstream::out);
-    if (fio.fail()) {
-        return false;
-    }
+void BlockCache::read(long block_id, char* data, int size, int shift) {
+    lock_guard<mutex> guard{lock};
+    const char* page = this->page(block_id, false);
+    copy(page + shift, page + shift + size, data);
+}
 
-    // measure device capacity
-    fio.seekg(0, fio.end);
-    device_capacity = fio.tellg();
+const char* BlockCache::pin(long block_id, int* page_index) {
+    lock_guard<mutex> guard{lock};
+    const char* page = this->page(block_id, false);
+    *page_index = static_cast<int>((page - data.data()) / block_size);
+    ++pages[*page_index].pins;
+    return page;
+}
 
-    // measure how many blocks are used for bitmask
-    n_bitmask_blocks = div_ceil(device_capacity, BLOCK_SIZE * BLOCK_SIZE * 8);
-    n_data_blocks = div_ceil(device_capacity, BLOCK_SIZE);
-    root_inode_id = n_bitmask_blocks; // use the first block after bitmask
+void BlockCache::unpin(int page_index) {
+    lock_guard<mutex> guard{lock};
+    assert(pages[page_index].pins > 0);
+    --pages[page_index].pins;
+}
 
-    // if first time (device not formatted)
-    if (!block_used(root_inode_id)) {
-        // FORMAT IT! (via creating root directory)
-        block_mark_used(root_inode_id);
+void BlockCache::write(long block_id, const char* data, int size, int shift) {
+    lock_guard<mutex> guard{lock};
+    char* page = this->page(block_id, size == block_size);
+    copy(data, data + size, page + shift);
+    mark_dirty(block_id);
+}
 
-        INode root_inode;
-        root_inode.n_links = 1;
-        root_inode.size = 0;
-        root_inode.type = FileType::Directory;
-        write_block(root_inode_id, &root_inode);
+bool BlockCache::read_cached(long block_id, char* data) {
+    lock_guard<mutex> guard{lock};
+    const char* page = find(block_id);
+    if (page == nullptr) {
+        return false;
     }
-
+    copy(page, page + block_size, data);
     return true;
 }
 
-void umount() {
-    device_capacity = -1;
-    n_bitmask_blocks = -1;
-    n_data_blocks = -1;
-    fio.close();
+bool BlockCache::write_cached(long block_id, const char* data) {
+    lock_guard<mutex> guard{lock};
+    char* page = find(block_id);
+    if (page == nullptr) {
+        return false;
+    }
+    copy(data, data + block_size, page);
+    mark_dirty(block_id);
+    return true;
 }
 
-string ls(const string& dirname) {
-    File dir{dirname};
-    int dir_size = dir.size();
-    vector<char> data(static_cast<size_t>(dir_size));
-    dir.read(data.data(), dir_size, 0);
-    assert(dir_size % sizeof(Link) == 0);
-    string result;
-    for (int n_file = 0; n_file < dir_size / sizeof(Link); ++n_file) {
-        auto& lnk = *reinterpret_cast<Link*>(data.data() + n_file * sizeof(Link));
-        result += lnk.filename;
-        result += '\n';
+void BlockCache::fill(long block_id, int n_blocks, const char* data) {
+    lock_guard<mutex> guard{lock};
+    for (int i = 0; i < n_blocks; ++i) {
+        if (index.count(block_id + i) != 0) {
+            continue;
+        }
+        // not referenced: blocks which are never read are the first to go
+        int page_index = evict();
+        pages[page_index] = Page{block_id + i, false, false, 0};
+        index[block_id + i] = page_index;
+        const char* block = data + static_cast<size_t>(i) * block_size;
+        copy(block, block + block_size, this->data.data() + static_cast<size_t>(page_index) * block_size);
     }
-
-    return result;
 }
 
-std::string ls() {
-    return ls(cwd);
+CacheStats BlockCache::stats() {
+    lock_guard<mutex> guard{lock};
+    return counters;
 }
 
-int create(const string& path, FileType type) {
-    if (find_inode_block_id(path) != BAD_BLOCK) {
-        return BAD_BLOCK;
+char* BlockCache::page(long block_id, bool overwrite) {
+    auto it = index.find(block_id);
+    if (it != index.end()) {
+        ++counters.hits;
+        pages[it->second].referenced = true;
+        return data.data() + static_cast<size_t>(it->second) * block_size;
+    }
+    ++counters.misses;
+    int page_index = evict();
+    pages[page_index] = Page{block_id, false, true, 0};
+    index[block_id] = page_index;
+    char* result = data.data() + static_cast<size_t>(page_index) * block_size;
+    if (!overwrite) {
+        try {
+            device->read(block_id * block_size, result, block_size);
+        } catch (const DeviceError&) {
+            // the page mustn't serve whatever it holds now
+            index.erase(block_id);
+            pages[page_index].block_id = BAD_BLOCK;
+            throw;
+        }
     }
+    return result;
+}
 
-    int inode_block_id = find_empty_block();
-    if (inode_block_id == BAD_BLOCK) {
-        return BAD_BLOCK;
+char* BlockCache::find(long block_id) {
+    auto it = index.find(block_id);
+    if (it == index.end()) {
+        return nullptr;
     }
+    ++counters.hits;
+    pages[it->second].referenced = true;
+    return data.data() + static_cast<size_t>(it->second) * block_size;
+}
 
-    block_mark_used(inode_block_id);
+void BlockCache::mark_dirty(long block_id) {
+    auto it = index.find(block_id);
+    assert(it != index.end());
+    pages[it->second].dirty = true;
+}
 
-    auto dirname = get_file_directory(path);
-    auto filename = get_filename(path);
-    if (filename.size() > FILENAME_MAX_LENGTH) {
-        return BAD_BLOCK;
+void BlockCache::flush() {
+    lock_guard<mutex> guard{lock};
+    vector<int> dirty_pages;
+    for (int page_index = 0; page_index < static_cast<int>(pages.size()); ++page_index) {
+        if (pages[page_index].dirty) {
+            dirty_pages.push_back(page_index);
+        }
     }
-    File dir{dirname};
-    int old_dir_size = dir.size();
-    dir.truncate(old_dir_size + sizeof(Link));
+    sort(dirty_pages.begin(), dirty_pages.end(), [this](int a, int b) {
+        return pages[a].block_id < pages[b].block_id;
+    });
+    // pages of consecutive blocks go to the device with one gathering write, all the writes are in flight at once
+    PendingRequests pending;
+    vector<iovec> iov;
+    for (size_t i = 0; i < dirty_pages.size(); ++i) {
+        auto& page = pages[dirty_pages[i]];
+        iov.push_back(iovec{data.data() + static_cast<size_t>(dirty_pages[i]) * block_size, static_cast<size_t>(block_size)});
+        if (i + 1 == dirty_pages.size() || pages[dirty_pages[i + 1]].block_id != page.block_id + 1) {
+            long first_block_id = page.block_id - static_cast<long>(iov.size()) + 1;
+            pending.add(device->submit_writev(first_block_id * block_size, iov.data(), static_cast<int>(iov.size())));
+            iov.clear();
+        }
+    }
+    // pages stay dirty if any write failed, the next flush retries them
+    pending.wait();
+    for (int page_index : dirty_pages) {
+        pages[page_index].dirty = false;
+        ++counters.writebacks;
+    }
+}
 
-    // Create link in root directory
-    Link lnk;
-    lnk.inode_block_id = inode_block_id;
-    strcpy(lnk.filename, filename.c_str());
-    dir.write(reinterpret_cast<char*>(&lnk), sizeof(Link), old_dir_size);
+int BlockCache::evict() {
+    for (int n_checked = 0;; ++n_checked) {
+        assert(n_checked <= 2 * static_cast<int>(pages.size()) && "all cache pages are pinned");
+        auto& page = pages[clock_hand];
+        int page_index = clock_hand;
+        clock_hand = (clock_hand + 1) % static_cast<int>(pages.size());
+        if (page.block_id == BAD_BLOCK) {
+            return page_index;
+        }
+        if (page.pins > 0) {
+            continue;
+        }
+        if (page.referenced) {
+            page.referenced = false;
+            continue;
+        }
+        if (page.dirty) {
+            write_back(page, page_index);
+        }
+        ++counters.evictions;
+        index.erase(page.block_id);
+        page.block_id = BAD_BLOCK;
+        return page_index;
+    }
+}
 
-    INode inode;
-    inode.size = 0;
-    inode.n_links = 1;
-    inode.type = type;
-    write_block(inode_block_id, &inode);
-    return inode_block_id;
+void BlockCache::write_back(Page& page, int page_index) {
+    device->write(page.block_id * block_size, data.data() + static_cast<size_t>(page_index) * block_size, block_size);
+    page.dirty = false;
+    ++counters.writebacks;
 }
 
-bool link(const string& target, const string& name_path) {
-    int target_inode = find_inode_block_id(target);
-    if (target_inode == BAD_BLOCK || find_inode_block_id(name_path) != BAD_BLOCK) {
-        return false;
+// Returns the device block holding the given block of the file (ZERO_BLOCK for holes)
+// and the number of the following file blocks which are mapped the same way (contiguous or holes).
+long inode_run(const INode& inode, int file_block, int* n_blocks) {
+    auto it = upper_bound(inode.extents.begin(), inode.extents.end(), file_block, [](int block, const Extent& extent) {
+        return block < extent.file_block + extent.length;
+    });
+    if (it == inode.extents.end()) {
+        *n_blocks = numeric_limits<int>::max();
+        return ZERO_BLOCK;
     }
+    if (file_block < it->file_block) {
+        *n_blocks = it->file_block - file_block;
+        return ZERO_BLOCK;
+    }
+    *n_blocks = it->file_block + it->length - file_block;
+    return it->start + (file_block - it->file_block);
+}
 
-    auto dirname = get_file_directory(name_path);
-    auto filename = get_filename(name_path);
-    if (filename.size() > FILENAME_MAX_LENGTH) {
-        return BAD_BLOCK;
+// returns the device block holding the given block of the file, ZERO_BLOCK for holes
+long inode_block(const INode& inode, int file_block) {
+    auto it = upper_bound(inode.extents.begin(), inode.extents.end(), file_block, [](int block, const Extent& extent) {
+        return block < extent.file_block;
+    });
+    if (it == inode.extents.begin()) {
+        return ZERO_BLOCK;
     }
+    --it;
+    if (file_block >= it->file_block + it->length) {
+        return ZERO_BLOCK;
+    }
+    return it->start + (file_block - it->file_block);
+}
 
-    File dir{dirname};
-    auto s_data = dir.cat();
-    vector<char> data(s_data.begin(), s_data.end());
-    int old_dir_size = data.size();
-    assert(old_dir_size % sizeof(Link) == 0);
+// maps a hole of the file to device blocks, merging with the neighbouring extents where possible
+void inode_map(INode& inode, int file_block, long start, int length) {
+    assert(length > 0);
+    auto it = upper_bound(inode.extents.begin(), inode.extents.end(), file_block, [](int block, const Extent& extent) {
+        return block < extent.file_block;
+    });
+    assert(it == inode.extents.end() || file_block + length <= it->file_block);
+    bool merge_prev = false;
+    if (it != inode.extents.begin()) {
+        auto& prev = *(it - 1);
+        assert(prev.file_block + prev.length <= file_block);
+        merge_prev = prev.file_block + prev.length == file_block && prev.start + prev.length == start;
+    }
+    bool merge_next = it != inode.extents.end() && file_block + length == it->file_block && start + length == it->start;
+    if (merge_prev && merge_next) {
+        (it - 1)->length += length + it->length;
+        inode.extents.erase(it);
+    } else if (merge_prev) {
+        (it - 1)->length += length;
+    } else if (merge_next) {
+        it->file_block = file_block;
+        it->start = start;
+        it->length += length;
+    } else {
+        inode.extents.insert(it, Extent{file_block, start, length});
+    }
+}
 
-    Link lnk;
-    strcpy(lnk.filename, filename.c_str());
-    lnk.inode_block_id = target_inode;
-    dir.truncate(old_dir_size + sizeof(Link));
-    dir.write(reinterpret_cast<char*>(&lnk), sizeof(Link), old_dir_size);
 
-    // add link
-    INode inode;
-    read_block(target_inode, &inode);
-    inode.n_links += 1;
-    write_block(target_inode, &inode);
+// true if all the bytes are zero. Words are OR-ed 64 bytes at a time without branching,
+// which the compiler turns into vector instructions.
+bool is_zero(const char* data, int size) {
+    int index = 0;
+    for (; index + 64 <= size; index += 64) {
+        uint64_t words[8];
+        memcpy(words, data + index, sizeof(words));
+        uint64_t any = 0;
+        for (uint64_t word : words) {
+            any |= word;
+        }
+        if (any != 0) {
+            return false;
+        }
+    }
+    for (; index < size; ++index) {
+        if (data[index] != 0) {
+            return false;
+        }
+    }
     return true;
 }
 
-bool unlink(const string& path) {
-    int target_inode = find_inode_block_id(path);
-    if (target_inode == BAD_BLOCK) {
-        return false;
+// The internal reads and writes take int sizes: calls transfer(done, n) for consecutive pieces
+// [done, done + n) of [0, size), stops when it returns false
+template <typename Transfer>
+bool in_pieces(long size, Transfer transfer) {
+    for (long done = 0; done < size;) {
+        int n = static_cast<int>(min(size - done, MAX_PIECE));
+        if (!transfer(done, n)) {
+            return false;
+        }
+        done += n;
     }
+    return true;
+}
 
-    auto dirname = get_file_directory(path);
-    auto filename = get_filename(path);
-
-    if (path.size() > FILENAME_MAX_LENGTH) {
-        return false;
+void Bitmap::load(Filesystem::Impl& fs) {
+    int n_bitmask_blocks = fs.n_bitmask_blocks;
+    words_per_block = fs.block_size * 8 / BITS_PER_WORD;
+    n_bits = fs.n_data_blocks;
+    words.assign(static_cast<size_t>(n_bitmask_blocks) * words_per_block, 0);
+    dirty.assign(static_cast<size_t>(n_bitmask_blocks), false);
+    fs.read_blocks(fs.bitmap_start, n_bitmask_blocks, reinterpret_cast<char*>(words.data()));
+    // the levels are built bottom up, bits past the end of a level count as full
+    summary.clear();
+    for (size_t n_entries = words.size(); summary.empty() || n_entries > 1; n_entries = summary.back().size()) {
+        const auto* below = summary.empty() ? nullptr : &summary.back();
+        vector<uint64_t> level(div_ceil(static_cast<long>(n_entries), BITS_PER_WORD), ~uint64_t{0});
+        for (size_t index = 0; index < n_entries; ++index) {
+            bool full = below == nullptr ? word_used(index) == ~uint64_t{0} : (*below)[index] == ~uint64_t{0};
+            if (!full) {
+                level[index / BITS_PER_WORD] &= ~(uint64_t{1} << (index % BITS_PER_WORD));
+            }
+        }
+        summary.push_back(move(level));
     }
+    next_free_hint = 0;
+}
 
-    File dir{dirname};
-    auto s_data = dir.cat();
-    vector<char> data(s_data.begin(), s_data.end());
-    int old_dir_size = data.size();
-    assert(old_dir_size % sizeof(Link) == 0);
-    for (int n_file = 0; n_file < old_dir_size / sizeof(Link); ++n_file) {
-        auto& lnk = *reinterpret_cast<Link*>(data.data() + n_file * sizeof(Link));
-        if (lnk.filename == filename) {
-            dereference_inode(lnk.inode_block_id);
-            dir.read(reinterpret_cast<char*>(&lnk), sizeof(Link), old_dir_size - sizeof(Link));
-            dir.write(reinterpret_cast<char*>(&lnk), sizeof(Link), n_file * sizeof(Link));
-            dir.truncate(old_dir_size - sizeof(Link));
-            return true;
+void Bitmap::flush(Filesystem::Impl& fs) {
+    for (int bitmask_block_id = 0; bitmask_block_id < static_cast<int>(dirty.size()); ++bitmask_block_id) {
+        if (dirty[bitmask_block_id]) {
+            auto block_words = words.data() + static_cast<size_t>(bitmask_block_id) * words_per_block;
+            fs.write_metadata_block(fs.bitmap_start + bitmask_block_id, reinterpret_cast<const char*>(block_words));
+            dirty[bitmask_block_id] = false;
         }
     }
+}
 
-    return false;
+void Bitmap::reset() {
+    words.clear();
+    summary.clear();
+    dirty.clear();
+    n_bits = 0;
+    next_free_hint = 0;
 }
 
-bool file_exists(const string& filename) {
-    return find_inode_block_id(filename) != BAD_BLOCK;
+uint64_t Bitmap::word_used(size_t word_idx) const {
+    long first_bit = static_cast<long>(word_idx) * BITS_PER_WORD;
+    if (first_bit + BITS_PER_WORD <= n_bits) {
+        return words[word_idx];
+    }
+    // bits past the end of the device are never handed out
+    long n_valid = max(0L, n_bits - first_bit);
+    return words[word_idx] | ~((uint64_t{1} << n_valid) - 1);
 }
 
-File::File(const string& filename, bool follow_symlink) : File(find_inode_block_id(filename), follow_symlink) {
+// propagates the fullness of a changed word up the summary, levels stop changing at some point
+void Bitmap::update_summary(size_t word_idx) {
+    bool full = word_used(word_idx) == ~uint64_t{0};
+    size_t index = word_idx;
+    for (auto& level : summary) {
+        uint64_t& word = level[index / BITS_PER_WORD];
+        bool was_full = word == ~uint64_t{0};
+        uint64_t bit = uint64_t{1} << (index % BITS_PER_WORD);
+        word = full ? word | bit : word & ~bit;
+        full = word == ~uint64_t{0};
+        if (full == was_full) {
+            return;
+        }
+        index /= BITS_PER_WORD;
+    }
+}
 
+bool Bitmap::test(long bit) const {
+    assert(0 <= bit && bit < n_bits);
+    return (words[bit / BITS_PER_WORD] >> (bit % BITS_PER_WORD) & 1) != 0;
 }
 
-File::File(int block_id, bool follow_symlink):
-        block_id{follow_symlink ? inode_follow_symlinks(block_id) : block_id } {
-    assert(block_id >= 0 && "file not found");
-    assert(is_mounted());
+void Bitmap::set(long bit) {
+    assert(!test(bit));
+    words[bit / BITS_PER_WORD] |= uint64_t{1} << (bit % BITS_PER_WORD);
+    update_summary(bit / BITS_PER_WORD);
+    dirty[bit / (words_per_block * BITS_PER_WORD)] = true;
+    if (bit == next_free_hint) {
+        ++next_free_hint;
+    }
 }
 
-string File::filestat() const {
-    assert(is_mounted());
+void Bitmap::set_run(long bit, int length) {
+    for (long end = bit + length; bit < end;) {
+        int offset = static_cast<int>(bit % BITS_PER_WORD);
+        int n = static_cast<int>(min<long>(BITS_PER_WORD - offset, end - bit));
+        uint64_t mask = (n == BITS_PER_WORD ? ~uint64_t{0} : (uint64_t{1} << n) - 1) << offset;
+        assert((words[bit / BITS_PER_WORD] & mask) == 0);
+        words[bit / BITS_PER_WORD] |= mask;
+        update_summary(bit / BITS_PER_WORD);
+        dirty[bit / (words_per_block * BITS_PER_WORD)] = true;
+        if (bit <= next_free_hint && next_free_hint < bit + n) {
+            next_free_hint = bit + n;
+        }
+        bit += n;
+    }
+}
 
-    INode inode;
-    read_block(block_id, &inode);
+void Bitmap::unset(long bit) {
+    assert(test(bit));
+    words[bit / BITS_PER_WORD] &= ~(uint64_t{1} << (bit % BITS_PER_WORD));
+    update_summary(bit / BITS_PER_WORD);
+    dirty[bit / (words_per_block * BITS_PER_WORD)] = true;
+    next_free_hint = min(next_free_hint, bit);
+}
 
-    string result = "Type: ";
-    if (inode.type == FileType::Regular) {
-        result += "regular";
-    } else if (inode.type == FileType::Symlink) {
-        result += "symlink\n";
-        result += "Points to: ";
-        result += cat();
-    } else {
-        // directory
-        result += "directory\n";
-        result += "Contains files: ";
-        result += to_string(inode.size / sizeof(Link));
+long Bitmap::find_unset() {
+    long bit = next_unset(next_free_hint);
+    next_free_hint = bit == -1 ? n_bits : bit;
+    return bit;
+}
+
+// First word at or after word_idx which has free bits, -1 if there are none: climbs the summary
+// while the rest of the summary word is full, then goes down along the first entries which aren't
+long Bitmap::next_free_word(size_t word_idx) const {
+    size_t index = word_idx;
+    size_t level = 0;
+    while (true) {
+        if (level == summary.size() || index / BITS_PER_WORD >= summary[level].size()) {
+            return -1;
+        }
+        uint64_t word = summary[level][index / BITS_PER_WORD] | ((uint64_t{1} << (index % BITS_PER_WORD)) - 1);
+        if (word != ~uint64_t{0}) {
+            index = index / BITS_PER_WORD * BITS_PER_WORD + __builtin_ctzll(~word);
+            break;
+        }
+        index = index / BITS_PER_WORD + 1;
+        ++level;
     }
-    result += '\n';
+    while (level > 0) {
+        --level;
+        index = index * BITS_PER_WORD + __builtin_ctzll(~summary[level][index]);
+    }
+    return static_cast<long>(index);
+}
 
+// first free bit at or after from, -1 if there are none
+long Bitmap::next_unset(long from) const {
+    if (from >= n_bits) {
+        return -1;
+    }
+    size_t word_idx = from / BITS_PER_WORD;
+    uint64_t word = word_used(word_idx) | ((uint64_t{1} << (from % BITS_PER_WORD)) - 1);
+    if (word == ~uint64_t{0}) {
+        long next = next_free_word(word_idx + 1);
+        if (next == -1) {
+            return -1;
+        }
+        word_idx = next;
+        word = word_used(word_idx);
+    }
+    return static_cast<long>(word_idx) * BITS_PER_WORD + __builtin_ctzll(~word);
+}
 
-    result += "Inode: ";
-    result += to_string(block_id);
-    result += '\n';
+int Bitmap::unset_run_length(long bit, int max_length) const {
+    int length = 0;
+    while (length < max_length && bit + length < n_bits) {
+        int offset = static_cast<int>((bit + length) % BITS_PER_WORD);
+        uint64_t word = words[(bit + length) / BITS_PER_WORD] >> offset;
+        int n_unset = word == 0 ? BITS_PER_WORD - offset : __builtin_ctzll(word);
+        length += n_unset;
+        if (offset + n_unset < BITS_PER_WORD) {
+            break;
+        }
+    }
+    return static_cast<int>(min<long>({length, max_length, n_bits - bit}));
+}
 
-    result += "Blocks uses(";
-    string blocks;
-    int blocks_used = 0;
-    for (int i = 0; i < div_ceil(inode.size, BLOCK_SIZE); ++i) {
-        if (inode.data_block_ids[i] >= 0) {
-            blocks += '#';
-            blocks += to_string(inode.data_block_ids[i]);
-            blocks += ' ';
-            ++blocks_used;
+// Looks for a run of length free bits, starting at goal and then from the beginning.
+// Returns the first (or the longest if there are no runs of that length) run found, -1 if there are no free bits.
+long Bitmap::find_unset_run(long goal, int length, int* run_length) {
+    long best = -1;
+    *run_length = 0;
+    int n_runs = 0;
+    for (long from : {goal, next_free_hint}) {
+        for (long bit = next_unset(from); bit != -1 && n_runs < RUN_SEARCH_LIMIT; bit = next_unset(bit + *run_length), ++n_runs) {
+            int n = unset_run_length(bit, length);
+            if (n > *run_length || best == -1) {
+                best = bit;
+                *run_length = n;
+            }
+            if (n == length) {
+                return best;
+            }
+            if (from != goal && bit >= goal) {
+                break;
+            }
         }
     }
-    result += to_string(blocks_used);
-    result += "): ";
-    result += blocks;
-    result += '\n';
+    return best;
+}
 
-    result += "Size: ";
-    result += to_string(inode.size);
-    result += " bytes";
-    result += '\n';
+bool Refcounts::load(Filesystem::Impl& fs) {
+    groups.clear();
+    counts_per_block = static_cast<int>((fs.block_size - sizeof(RefcountBlockHeader)) / sizeof(uint32_t));
+    first_block = fs.first_data_block;
+    head_dirty = false;
+    SuperBlock super;
+    fs.read_metadata_block(0, reinterpret_cast<char*>(&super), sizeof(super));
+    vector<char> block(static_cast<size_t>(fs.block_size));
+    for (long block_id = super.refcount_head; block_id != 0;) {
+        if (block_id < first_block || block_id >= fs.n_device_blocks) {
+            return false;
+        }
+        fs.read_metadata_block(block_id, block.data());
+        const auto& header = *reinterpret_cast<const RefcountBlockHeader*>(block.data());
+        if (header.magic != REFCOUNT_MAGIC || (!groups.empty() && header.group <= groups.rbegin()->first)) {
+            return false;
+        }
+        Group group{block_id, vector<uint32_t>(static_cast<size_t>(counts_per_block)), header.n_shared, false};
+        memcpy(group.counts.data(), block.data() + sizeof(header), group.counts.size() * sizeof(uint32_t));
+        groups.emplace(header.group, move(group));
+        block_id = header.next;
+    }
+    return true;
+}
 
-    result += "Number of (hard) links: ";
-    result += to_string(inode.n_links);
-    result += '\n';
+void Refcounts::flush(Filesystem::Impl& fs) {
+    vector<char> block(static_cast<size_t>(fs.block_size), '\0');
+    for (auto it = groups.begin(); it != groups.end(); ++it) {
+        auto& group = it->second;
+        if (!group.dirty) {
+            continue;
+        }
+        auto next = std::next(it);
+        RefcountBlockHeader header{REFCOUNT_MAGIC, group.n_shared, it->first, next == groups.end() ? 0 : next->second.block_id};
+        memcpy(block.data(), &header, sizeof(header));
+        memcpy(block.data() + sizeof(header), group.counts.data(), group.counts.size() * sizeof(uint32_t));
+        fs.write_metadata_block(group.block_id, block.data());
+        group.dirty = false;
+    }
+    if (head_dirty) {
+        auto super = fs.superblock();
+        fs.write_metadata_block(0, reinterpret_cast<const char*>(&super), sizeof(super));
+        head_dirty = false;
+    }
+}
 
-    return result;
+void Refcounts::reset() {
+    groups.clear();
+    counts_per_block = 0;
+    head_dirty = false;
 }
 
-void File::read(char* data, int size, int shift) const {
-    assert(is_mounted());
-    INode inode;
-    read_block(block_id, &inode);
-    assert(0 <= size);
-    assert(0 <= shift);
-    assert(shift + size <= inode.size);
-    int index = 0;
-    while (size > 0) {
-        int block_index = shift / BLOCK_SIZE;
-        int& block_id = inode.data_block_ids[block_index];
-        int s = min(size, ((block_index + 1) * BLOCK_SIZE) - shift);
-        if (block_id != ZERO_BLOCK) {
-            read_block(block_id, data + index, s, shift % BLOCK_SIZE);
-        } else {
-            // zero data optimization (only nulls in file block)
-            fill(data + index, data + index + s, '\0');
+long Refcounts::group_of(long block_id) const {
+    return (block_id - first_block) / counts_per_block;
+}
+
+uint32_t Refcounts::get(long block_id) const {
+    if (groups.empty()) {
+        return 0;
+    }
+    auto it = groups.find(group_of(block_id));
+    return it == groups.end() ? 0 : it->second.counts[(block_id - first_block) % counts_per_block];
+}
+
+bool Refcounts::increment(Filesystem::Impl& fs, long block_id) {
+    long group_index = group_of(block_id);
+    auto it = groups.find(group_index);
+    if (it == groups.end()) {
+        // the refcount block goes next to the blocks it describes
+        int n_allocated;
+        long bit = fs.bitmap.find_unset_run(group_index * counts_per_block, 1, &n_allocated);
+        if (bit == -1) {
+            return false;
         }
-        shift += s;
-        size -= s;
-        index += s;
+        fs.bitmap.set(bit);
+        it = groups.emplace(group_index, Group{bit + first_block, vector<uint32_t>(static_cast<size_t>(counts_per_block)), 0, true}).first;
+        mark_previous_dirty(it);
+    }
+    auto& group = it->second;
+    uint32_t& count = group.counts[(block_id - first_block) % counts_per_block];
+    if (count++ == 0) {
+        ++group.n_shared;
     }
+    group.dirty = true;
+    return true;
 }
 
-string File::cat() const {
-    vector<char> data(static_cast<size_t>(size()));
-    read(data.data(), data.size(), 0);
-    string result(data.begin(), data.end());
-    assert(result.size() == data.size());
+void Refcounts::decrement(Filesystem::Impl& fs, long block_id) {
+    auto it = groups.find(group_of(block_id));
+    assert(it != groups.end());
+    auto& group = it->second;
+    uint32_t& count = group.counts[(block_id - first_block) % counts_per_block];
+    assert(count > 0);
+    group.dirty = true;
+    if (--count != 0 || --group.n_shared != 0) {
+        return;
+    }
+    fs.bitmap.unset(group.block_id - first_block);
+    fs.journal_forget(group.block_id, 1);
+    mark_previous_dirty(it);
+    groups.erase(it);
+}
+
+bool Refcounts::empty() const {
+    return groups.empty();
+}
+
+long Refcounts::head() const {
+    return groups.empty() ? 0 : groups.begin()->second.block_id;
+}
+
+void Refcounts::mark_previous_dirty(map<long, Group>::iterator it) {
+    if (it == groups.begin()) {
+        head_dirty = true;
+    } else {
+        prev(it)->second.dirty = true;
+    }
+}
+
+long DedupIndex::find(uint64_t fingerprint) const {
+    auto it = blocks.find(fingerprint);
+    return it == blocks.end() ? BAD_BLOCK : it->second;
+}
+
+void DedupIndex::insert(uint64_t fingerprint, long block_id) {
+    erase(block_id);
+    if (blocks.emplace(fingerprint, block_id).second) {
+        fingerprints.emplace(block_id, fingerprint);
+    }
+}
+
+void DedupIndex::erase(long block_id) {
+    auto it = fingerprints.find(block_id);
+    if (it != fingerprints.end()) {
+        blocks.erase(it->second);
+        fingerprints.erase(it);
+    }
+}
+
+vector<DedupEntry> DedupIndex::entries() const {
+    vector<DedupEntry> result;
+    result.reserve(blocks.size());
+    for (const auto& kv : blocks) {
+        result.push_back(DedupEntry{kv.first, kv.second});
+    }
     return result;
 }
 
-bool File::write(const char* data, int size, int shift) {
-    assert(is_mounted());
-    INode inode;
-    read_block(block_id, &inode);
-    assert(0 <= size);
-    assert(0 <= shift);
-    assert(shift + size <= inode.size);
-    int index = 0;
-    bool inode_updated = false;
-    while (size > 0) {
-        int next_block_index = shift / BLOCK_SIZE;
-        int& next_block_id = inode.data_block_ids[next_block_index];
-        if (next_block_id == ZERO_BLOCK) {
-            next_block_id = find_empty_block();
-            if (next_block_id == BAD_BLOCK) {
-                inode.size = shift;
-                write_block(block_id, &inode);
-                return false;
-            }
-            block_mark_used(next_block_id);
-            inode_updated = true;
+void DedupIndex::reset() {
+    blocks.clear();
+    fingerprints.clear();
+}
+
+INodeCache::INodeCache(Filesystem::Impl& fs) : fs{fs} {
+
+}
+
+INode& INodeCache::pin(int block_id) {
+    lock_guard<mutex> guard{lock};
+    auto it = entries.find(block_id);
+    if (it == entries.end()) {
+        auto& entry = insert(block_id);
+        try {
+            fs.read_inode(block_id, &entry.inode);
+        } catch (...) {
+            // the entry was never filled, a later pin reads the inode again
+            entries.erase(block_id);
+            throw;
         }
-        int s = min(size, ((next_block_index + 1) * BLOCK_SIZE) - shift);
-        write_block(next_block_id, data + index, s, shift % BLOCK_SIZE);
-        shift += s;
-        size -= s;
-        index += s;
+        return entry.inode;
     }
-    if (inode_updated) {
-        write_block(block_id, &inode);
+    auto& entry = it->second;
+    if (entry.refs++ == 0) {
+        lru.erase(entry.lru_pos);
     }
-    return true;
+    return entry.inode;
 }
 
-int File::size() const {
-    assert(is_mounted());
-    INode inode;
-    read_block(block_id, &inode);
-    return inode.size;
+INode& INodeCache::pinned(int block_id) {
+    lock_guard<mutex> guard{lock};
+    auto& entry = entries.at(block_id);
+    assert(entry.refs > 0);
+    return entry.inode;
 }
 
-FileType File::type() const {
-    assert(is_mounted());
-    INode inode;
-    read_block(block_id, &inode);
-    return inode.type;
+INode& INodeCache::add(int block_id) {
+    lock_guard<mutex> guard{lock};
+    assert(entries.find(block_id) == entries.end());
+    auto& entry = insert(block_id);
+    entry.dirty = true;
+    return entry.inode;
 }
 
-int File::inode_id() const {
-    return block_id;
+// creates a pinned entry
+INodeCache::Entry& INodeCache::insert(int block_id) {
+    shrink();
+    auto& entry = entries[block_id];
+    entry.refs = 1;
+    entry.dirty = false;
+    return entry;
 }
 
-bool File::truncate(int size) {
-    assert(is_mounted());
-    INode inode;
-    read_block(block_id, &inode);
+INode* INodeCache::unpin(int block_id) {
+    lock_guard<mutex> guard{lock};
+    auto& entry = entries.at(block_id);
+    assert(entry.refs > 0);
+    if (--entry.refs > 0) {
+        return nullptr;
+    }
+    if (entry.inode.n_links == 0) {
+        // stays out of the LRU list until erase(), flush() must not touch it either
+        entry.dirty = false;
+        return &entry.inode;
+    }
+    entry.lru_pos = lru.insert(lru.end(), block_id);
+    return nullptr;
+}
 
-    if (size == inode.size) return true;
+void INodeCache::mark_dirty(int block_id) {
+    lock_guard<mutex> guard{lock};
+    entries.at(block_id).dirty = true;
+}
 
-    int n_old_blocks = div_ceil(inode.size, BLOCK_SIZE);
-    int n_blocks = div_ceil(size, BLOCK_SIZE);
-    assert(n_blocks <= BLOCKS_PER_INODE && "too big file");
-    if (n_blocks < n_old_blocks) {
-        for (int block_index = n_blocks; block_index < n_old_blocks; ++block_index) {
-            if (inode.data_block_ids[block_index] >= 0) {
-                block_mark_unused(inode.data_block_ids[block_index]);
+void INodeCache::erase(int block_id) {
+    lock_guard<mutex> guard{lock};
+    auto it = entries.find(block_id);
+    if (it == entries.end()) {
+        return;
+    }
+    assert(it->second.refs == 0 && it->second.inode.n_links == 0);
+    entries.erase(it);
+}
+
+void INodeCache::flush() {
+    // dirty inodes are pinned and written without the cache lock, their own locks come first
+    vector<int> dirty_ids;
+    {
+        lock_guard<mutex> guard{lock};
+        for (auto& kv : entries) {
+            if (kv.second.dirty) {
+                if (kv.second.refs++ == 0) {
+                    lru.erase(kv.second.lru_pos);
+                }
+                dirty_ids.push_back(kv.first);
             }
         }
-    } else {
-        if (inode.size % BLOCK_SIZE != 0 && inode.data_block_ids[n_old_blocks - 1] != ZERO_BLOCK) {
-            char tail_data[BLOCK_SIZE];
-            read_block(inode.data_block_ids[n_old_blocks - 1], tail_data);
-            fill(tail_data + inode.size % BLOCK_SIZE, tail_data + BLOCK_SIZE, '\0');
-            write_block(inode.data_block_ids[n_old_blocks - 1], tail_data);
+    }
+    for (int block_id : dirty_ids) {
+        auto& inode = pinned(block_id);
+        {
+            shared_lock<shared_mutex> inode_guard{inode.lock};
+            {
+                lock_guard<mutex> guard{lock};
+                entries.at(block_id).dirty = false;
+            }
+            fs.write_inode(block_id, inode);
         }
-        fill(inode.data_block_ids + n_old_blocks, inode.data_block_ids + n_blocks, ZERO_BLOCK);
+        fs.release_inode(block_id);
     }
+}
 
-    inode.size = size;
-    write_block(block_id, &inode);
-    return true;
+void INodeCache::reset() {
+    lock_guard<mutex> guard{lock};
+    entries.clear();
+    lru.clear();
 }
 
-void File::close() const {
-    // do nothing
+void INodeCache::shrink() {
+    while (static_cast<int>(lru.size()) >= INODE_CACHE_SIZE) {
+        auto it = entries.find(lru.front());
+        if (it->second.dirty) {
+            fs.write_inode(it->first, it->second.inode);
+        }
+        entries.erase(it);
+        lru.pop_front();
+    }
 }
 
-File::~File() {
-    close();
+DentryCache::Key::Key(int dir_inode_id, const char* name, size_t length) : dir_inode_id{dir_inode_id} {
+    assert(length <= FILENAME_MAX_LENGTH);
+    copy(name, name + length, this->name);
+    fill(this->name + length, end(this->name), '\0');
 }
 
-// lab 4
-bool mkdir(const string& dirname) {
-    return create(dirname, FileType::Directory) != BAD_BLOCK;
+bool DentryCache::Key::operator==(const Key& other) const {
+    return dir_inode_id == other.dir_inode_id && memcmp(name, other.name, sizeof(name)) == 0;
 }
 
-bool rmdir(const string& dirname) {
-    if (dirname == ROOTDIR_NAME) {
-        return false;
+size_t DentryCache::KeyHash::operator()(const Key& key) const {
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ull ^ static_cast<uint32_t>(key.dir_inode_id);
+    for (char c : key.name) {
+        hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211ull;
     }
-    File dir{dirname};
-    auto data = dir.cat();
-    size_t dir_size = data.size();
-    assert(data.size() % sizeof(Link) == 0);
+    return static_cast<size_t>(hash);
+}
 
-    for (int n_file = 0; n_file < dir_size / sizeof(Link); ++n_file) {
-        auto& lnk = *reinterpret_cast<const Link*>(data.data() + n_file * sizeof(Link));
-        dereference_inode(lnk.inode_block_id);
+bool DentryCache::find(int dir_inode_id, const char* name, size_t length, int* inode_id) const {
+    lock_guard<mutex> guard{lock};
+    auto it = entries.find(Key{dir_inode_id, name, length});
+    if (it == entries.end()) {
+        return false;
     }
-    unlink(dirname);
+    lru.splice(lru.end(), lru, it->second.lru_pos);
+    *inode_id = it->second.inode_id;
     return true;
 }
 
-bool cd(const string& dirname) {
-    // fixme VERY bad and ad-hoc solution for paths with ".." and "."
-    if (dirname == ".") return true;
-    if (dirname == "..") {
-        auto sep_pos = cwd.find_last_of(PATH_SEPARATOR);
-        if (sep_pos == string::npos) {
-            return false;
-        } else if (sep_pos == 0) {
-            cwd = ROOTDIR_NAME;
+void DentryCache::insert(int dir_inode_id, const char* name, size_t length, int inode_id) {
+    lock_guard<mutex> guard{lock};
+    Key key{dir_inode_id, name, length};
+    auto it = entries.find(key);
+    if (it != entries.end()) {
+        it->second.inode_id = inode_id;
+        lru.splice(lru.end(), lru, it->second.lru_pos);
+        return;
+    }
+    if (static_cast<int>(entries.size()) >= DENTRY_CACHE_SIZE) {
+        entries.erase(lru.front());
+        lru.pop_front();
+    }
+    entries.emplace(key, Entry{inode_id, lru.insert(lru.end(), key)});
+}
+
+void DentryCache::erase_dir(int dir_inode_id) {
+    lock_guard<mutex> guard{lock};
+    for (auto it = entries.begin(); it != entries.end();) {
+        if (it->first.dir_inode_id == dir_inode_id) {
+            lru.erase(it->second.lru_pos);
+            it = entries.erase(it);
         } else {
-            cwd = cwd.substr(0, sep_pos);
+            ++it;
         }
-        return true;
     }
-    auto new_cwd = join_path(cwd, dirname);
-    if (!file_exists(new_cwd)) {
-        return false;
+}
+
+void DentryCache::reset() {
+    lock_guard<mutex> guard{lock};
+    entries.clear();
+    lru.clear();
+}
+
+Descriptor::Descriptor(int inode_id, INode& inode) : inode_id{inode_id}, inode{inode} {
+
+}
+
+int DescriptorTable::add(shared_ptr<Descriptor> descriptor) {
+    lock_guard<mutex> guard{lock};
+    int fd;
+    if (free_fds.empty()) {
+        fd = static_cast<int>(descriptors.size());
+        descriptors.push_back(move(descriptor));
+    } else {
+        fd = free_fds.top();
+        free_fds.pop();
+        descriptors[fd] = move(descriptor);
     }
-    cwd = new_cwd;
-    return true;
+    return fd;
 }
 
-string pwd() {
-    if (is_mounted()) {
-        return cwd;
+shared_ptr<Descriptor> DescriptorTable::find(int fd) const {
+    lock_guard<mutex> guard{lock};
+    if (fd < 0 || fd >= static_cast<int>(descriptors.size())) {
+        return nullptr;
+    }
+    return descriptors[fd];
+}
+
+shared_ptr<Descriptor> DescriptorTable::remove(int fd) {
+    lock_guard<mutex> guard{lock};
+    if (fd < 0 || fd >= static_cast<int>(descriptors.size()) || descriptors[fd] == nullptr) {
+        return nullptr;
+    }
+    free_fds.push(fd);
+    return move(descriptors[fd]);
+}
+
+void DescriptorTable::reset() {
+    lock_guard<mutex> guard{lock};
+    descriptors.clear();
+    free_fds = {};
+}
+
+void Journal::reset() {
+    start = -1;
+    n_blocks = 0;
+    head = -1;
+    sequence = 0;
+    active = false;
+    blocks.clear();
+    revoked.clear();
+    freed.clear();
+    logged.clear();
+}
+
+void Histogram::add(long ns) {
+    ns = max(ns, 1L);
+    count.fetch_add(1, memory_order_relaxed);
+    total_ns.fetch_add(ns, memory_order_relaxed);
+    long seen = max_ns.load(memory_order_relaxed);
+    while (ns > seen && !max_ns.compare_exchange_weak(seen, ns, memory_order_relaxed)) {
+    }
+    int bucket = min(LATENCY_BUCKETS - 1, 63 - __builtin_clzl(static_cast<unsigned long>(ns)));
+    buckets[bucket].fetch_add(1, memory_order_relaxed);
+}
+
+LatencyStats Histogram::snapshot() const {
+    LatencyStats result;
+    result.count = count.load(memory_order_relaxed);
+    result.total_ns = total_ns.load(memory_order_relaxed);
+    result.max_ns = max_ns.load(memory_order_relaxed);
+    for (int bucket = 0; bucket < LATENCY_BUCKETS; ++bucket) {
+        result.buckets[bucket] = buckets[bucket].load(memory_order_relaxed);
+    }
+    return result;
+}
+
+void Histogram::reset() {
+    count.store(0, memory_order_relaxed);
+    total_ns.store(0, memory_order_relaxed);
+    max_ns.store(0, memory_order_relaxed);
+    for (auto& bucket : buckets) {
+        bucket.store(0, memory_order_relaxed);
+    }
+}
+
+bool Instrumentation::enabled() const {
+    return on.load(memory_order_relaxed);
+}
+
+void Instrumentation::add(atomic<long>& counter, long n) {
+    if (enabled()) {
+        counter.fetch_add(n, memory_order_relaxed);
+    }
+}
+
+Stats Instrumentation::snapshot() const {
+    Stats result;
+    result.block_reads = block_reads.snapshot();
+    result.block_writes = block_writes.snapshot();
+    result.blocks_read = blocks_read.load(memory_order_relaxed);
+    result.blocks_written = blocks_written.load(memory_order_relaxed);
+    result.bitmap_scans = bitmap_scans.snapshot();
+    result.dir_scans = dir_scans.snapshot();
+    result.dir_entries_scanned = dir_entries_scanned.load(memory_order_relaxed);
+    for (int call = 0; call < static_cast<int>(Call::Count); ++call) {
+        auto call_stats = calls[call].snapshot();
+        if (call_stats.count > 0) {
+            result.calls.emplace_back(CALL_NAMES[call], call_stats);
+        }
+    }
+    return result;
+}
+
+void Instrumentation::reset() {
+    block_reads.reset();
+    block_writes.reset();
+    blocks_read.store(0, memory_order_relaxed);
+    blocks_written.store(0, memory_order_relaxed);
+    bitmap_scans.reset();
+    dir_scans.reset();
+    dir_entries_scanned.store(0, memory_order_relaxed);
+    for (auto& call : calls) {
+        call.reset();
+    }
+}
+
+Timer::Timer(const Instrumentation& stats, Histogram& histogram) :
+        histogram{stats.enabled() ? &histogram : nullptr} {
+    if (this->histogram != nullptr) {
+        start = chrono::steady_clock::now();
+    }
+}
+
+Timer::Timer(Instrumentation& stats, Call call) : Timer{stats, stats.calls[static_cast<int>(call)]} {
+
+}
+
+Timer::~Timer() {
+    if (histogram != nullptr) {
+        histogram->add(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+    }
+}
+
+INodeRef::INodeRef(Filesystem::Impl& fs, int inode_id) : fs{fs}, inode_id{inode_id}, inode{fs.inodes.pin(inode_id)} {
+
+}
+
+INodeRef::~INodeRef() {
+    fs.release_inode(inode_id);
+}
+
+INode& INodeRef::operator*() const {
+    return inode;
+}
+
+INode* INodeRef::operator->() const {
+    return &inode;
+}
+
+int INodeRef::id() const {
+    return inode_id;
+}
+
+BlockView::BlockView(Filesystem::Impl& fs, long block_id) : fs{fs} {
+    assert(fs.is_mounted());
+    assert(0 <= block_id && block_id < fs.n_device_blocks);
+    const char* mapping = fs.device->mapping();
+    if (fs.journal_holds(block_id, 1)) {
+        block_copy.reset(new char[MAX_BLOCK_SIZE]);
+        fs.read_metadata_block(block_id, block_copy.get());
+        block = block_copy.get();
+    } else if (mapping != nullptr) {
+        fs.stats.add(fs.stats.blocks_read, 1);
+        block = mapping + block_id * fs.block_size;
     } else {
-        return "NOT MOUNTED!";
+        fs.stats.add(fs.stats.blocks_read, 1);
+        block = fs.cache.pin(block_id, &page_index);
     }
 }
 
-bool symlink(const string& target, const string& name) {
-    int inode_block_id = create(name, FileType::Symlink);
-    if (inode_block_id == BAD_BLOCK) {
-        return false;
+BlockView::~BlockView() {
+    if (page_index != -1) {
+        fs.cache.unpin(page_index);
     }
-    File file{inode_block_id, false};
-    file.truncate(target.size());
-    file.write(target.c_str(), target.size(), 0);
-    return true;
+}
+
+const char* BlockView::data() const {
+    return block;
+}
+
+template <typename T>
+const T& BlockView::as() const {
+    static_assert(sizeof(T) <= MAX_BLOCK_SIZE, "type doesn't fit into a block");
+    return *reinterpret_cast<const T*>(block);
+}
+
+uint32_t filename_hash(const char* filename) {
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (; *filename != '\0'; ++filename) {
+        hash = (hash ^ static_cast<unsigned char>(*filename)) * 16777619u;
+    }
+    return hash;
+}
+
+int dir_index_child(const DirNode& node, uint32_t hash) {
+    assert(node.header.depth > 0 && node.header.count > 0);
+    auto begin = node.entries;
+    auto end = node.entries + node.header.count;
+    auto it = upper_bound(begin, end, hash, [](uint32_t h, const DirIndexEntry& entry) {
+        return h < entry.hash;
+    });
+    return it == begin ? 0 : static_cast<int>(it - begin) - 1;
+}
+
+string get_filename(const string& path) {
+    const auto sep_index = path.find_last_of(PATH_SEPARATOR);
+    if (sep_index == string::npos) {
+        return path;
+    } else {
+        return path.substr(sep_index + 1);
+    }
+}
+
+string join_path(string part1, string part2) {
+    if (part1 == ROOTDIR_NAME) {
+        return PATH_SEPARATOR + part2;
+    }
+    return part1 + PATH_SEPARATOR + part2;
+}
+} // END OF INTERNAL LINKAGE SECTION
+
+bool Readahead::advance(long shift, int size, long file_size, long max_window, long* start, long* end) {
+    lock_guard<mutex> guard{lock};
+    long read_end = shift + size;
+    bool sequential = shift == next_offset;
+    next_offset = read_end;
+    if (size >= READAHEAD_MAX_READ) {
+        window = 0;
+        ahead_end = 0;
+        return false;
+    }
+    if (!sequential) {
+        window = window / 2 < READAHEAD_MIN_SIZE ? 0 : window / 2;
+        ahead_end = 0;
+        return false;
+    }
+    window = min(max_window, window == 0 ? max(READAHEAD_MIN_SIZE, 2L * size) : 2 * window);
+    if (read_end + window / 2 <= ahead_end) {
+        return false;
+    }
+    *start = max(read_end, ahead_end);
+    *end = min(file_size, read_end + window);
+    ahead_end = max(ahead_end, *end);
+    return *start < *end;
+}
+
+bool Filesystem::Impl::is_mounted() const {
+    return device_capacity != -1 && device != nullptr;
+}
+
+bool Filesystem::Impl::mount(const string& filename, DeviceMode mode, bool enable_dedup) {
+    umount();
+    device = open_device(filename, mode);
+    if (device == nullptr) {
+        return false;
+    }
+
+    device_capacity = device->capacity();
+    SuperBlock super{};
+    if (device_capacity >= static_cast<long>(sizeof(super))) {
+        device->read(0, reinterpret_cast<char*>(&super), sizeof(super));
+    }
+    if (super.magic == SUPERBLOCK_MAGIC && super.version == NARROW_SUPERBLOCK_VERSION) {
+        NarrowSuperBlock narrow;
+        memcpy(&narrow, &super, sizeof(narrow));
+        super = SuperBlock{narrow.magic, narrow.version, narrow.block_size, narrow.n_blocks, narrow.n_bitmask_blocks,
+                           narrow.n_data_blocks, narrow.root_inode, 0, 0};
+    }
+    if (super.magic == SUPERBLOCK_MAGIC) {
+        bool supported = (super.version == SUPERBLOCK_VERSION || super.version == UNSHARED_SUPERBLOCK_VERSION
+                          || super.version == NARROW_SUPERBLOCK_VERSION)
+                && super.block_size >= MIN_BLOCK_SIZE && super.block_size <= MAX_BLOCK_SIZE
+                && (super.block_size & (super.block_size - 1)) == 0;
+        if (!supported || super.n_blocks < 2 || super.n_blocks > device_capacity / super.block_size) {
+            umount();
+            return false;
+        }
+        set_geometry(super.block_size, super.n_blocks, true, super.version != NARROW_SUPERBLOCK_VERSION);
+        if (n_bitmask_blocks != super.n_bitmask_blocks || n_data_blocks != super.n_data_blocks
+                || root_inode_id != super.root_inode) {
+            umount();
+            return false;
+        }
+    } else if (device_capacity / LEGACY_BLOCK_SIZE <= numeric_limits<int>::max()) {
+        set_geometry(LEGACY_BLOCK_SIZE, device_capacity / LEGACY_BLOCK_SIZE, false, false);
+    } else {
+        // images without a superblock aren't this large, so the device isn't formatted
+        if (!format(DEFAULT_BLOCK_SIZE)) {
+            umount();
+            return false;
+        }
+        return true;
+    }
+    // committed transactions go home before anything is read
+    if (journal_load()) {
+        journal_replay();
+    }
+    cache.init(device.get(), CACHE_PAGES, block_size);
+    bitmap.load(*this);
+    if (wide && !refcounts.load(*this)) {
+        umount();
+        return false;
+    }
+
+    dedup = enable_dedup && wide;
+
+    // if first time (device not formatted)
+    if (!block_used(root_inode_id)) {
+        // FORMAT IT! (with a superblock and the default block size)
+        if (!format(DEFAULT_BLOCK_SIZE)) {
+            umount();
+            return false;
+        }
+    } else if (wide) {
+        dedup_load(super.dedup_head);
+    }
+
+    return true;
+}
+
+// Formats the image: writes the superblock and an empty bitmask, creates the root directory
+// and the journal. The file system is left unmounted.
+bool Filesystem::Impl::mkfs(const string& filename, int new_block_size, DeviceMode mode) {
+    umount();
+    if (new_block_size < MIN_BLOCK_SIZE || new_block_size > MAX_BLOCK_SIZE || (new_block_size & (new_block_size - 1)) != 0) {
+        return false;
+    }
+    device = open_device(filename, mode);
+    if (device == nullptr) {
+        return false;
+    }
+    device_capacity = device->capacity();
+    bool result = format(new_block_size);
+    umount();
+    return result;
+}
+
+// Layout of the image, derived from the block size and the number of blocks. Images with a superblock
+// have it in the first block, the bitmask follows. The root inode is the first block after the bitmask.
+void Filesystem::Impl::set_geometry(int new_block_size, long new_n_blocks, bool has_superblock, bool wide_layout) {
+    block_size = new_block_size;
+    wide = wide_layout;
+    n_device_blocks = new_n_blocks;
+    bitmap_start = has_superblock ? 1 : 0;
+    if (has_superblock) {
+        n_bitmask_blocks = static_cast<int>(div_ceil(n_device_blocks - bitmap_start, block_size * 8));
+    } else {
+        // measure how many blocks are used for bitmask
+        n_bitmask_blocks = static_cast<int>(div_ceil(device_capacity, block_size * block_size * 8));
+    }
+    first_data_block = bitmap_start + n_bitmask_blocks;
+    n_data_blocks = n_device_blocks - first_data_block;
+    root_inode_id = first_data_block; // use the first block after bitmask
+    if (wide) {
+        use_layout<int64_t, WideExtent>();
+    } else {
+        use_layout<int, NarrowExtent>();
+    }
+    links_per_dir_leaf = (block_size - sizeof(DirNodeHeader)) / sizeof(Link);
+    entries_per_dir_index = (block_size - sizeof(DirNodeHeader)) / sizeof(DirIndexEntry);
+    switch (block_size) {
+    case 512:
+        use_block_size<512>();
+        break;
+    case 1024:
+        use_block_size<1024>();
+        break;
+    case 2048:
+        use_block_size<2048>();
+        break;
+    default:
+        assert(block_size == MAX_BLOCK_SIZE);
+        use_block_size<MAX_BLOCK_SIZE>();
+        break;
+    }
+}
+
+// capacities of the on-disk inode structures of the image
+template <typename Size, typename DiskExtent>
+void Filesystem::Impl::use_layout() {
+    inode_extents = (block_size - DiskINode<Size, DiskExtent>::HEADER_SIZE) / sizeof(DiskExtent);
+    inline_size = inode_extents * sizeof(DiskExtent);
+    extents_per_block = (block_size - ExtentBlock<DiskExtent>::HEADER_SIZE) / sizeof(DiskExtent);
+    // file block indices are ints
+    max_file_size = min(static_cast<long>(numeric_limits<Size>::max()), static_cast<long>(numeric_limits<int>::max()) * block_size);
+}
+
+template <int BlockSize>
+void Filesystem::Impl::use_block_size() {
+    file_read_sized = &Impl::file_read_blocks<BlockSize>;
+    file_write_sized = &Impl::file_write_blocks<BlockSize>;
+}
+
+// Writes a fresh file system over the whole opened device
+bool Filesystem::Impl::format(int new_block_size) {
+    long new_n_blocks = device_capacity / new_block_size;
+    // the superblock, the bitmask and the root inode at least
+    if (new_n_blocks < 2 + div_ceil(new_n_blocks - 1, new_block_size * 8)) {
+        return false;
+    }
+    journal.reset();
+    set_geometry(new_block_size, new_n_blocks, true, true);
+
+    // the bitmask of a large device is zeroed with few requests
+    vector<char> zeros(static_cast<size_t>(min(n_bitmask_blocks, FORMAT_CHUNK_BLOCKS)) * block_size, '\0');
+    for (int bitmask_block_id = 0; bitmask_block_id < n_bitmask_blocks; bitmask_block_id += FORMAT_CHUNK_BLOCKS) {
+        int n_blocks = min(FORMAT_CHUNK_BLOCKS, n_bitmask_blocks - bitmask_block_id);
+        device->write(static_cast<long>(bitmap_start + bitmask_block_id) * block_size, zeros.data(), n_blocks * block_size);
+    }
+    vector<char> block(static_cast<size_t>(block_size), '\0');
+    refcounts.reset();
+    dedup_head = 0;
+    auto super = superblock();
+    copy(reinterpret_cast<const char*>(&super), reinterpret_cast<const char*>(&super + 1), block.begin());
+    device->write(0, block.data(), block_size);
+
+    inodes.reset();
+    dentries.reset();
+    cache.init(device.get(), CACHE_PAGES, block_size);
+    bitmap.load(*this);
+    refcounts.load(*this);
+    block_mark_used(root_inode_id);
+    auto& root_inode = inodes.add(root_inode_id);
+    root_inode.n_links = 1;
+    root_inode.size = 0;
+    root_inode.type = FileType::Directory;
+    release_inode(root_inode_id);
+    journal_format();
+    return true;
+}
+
+SuperBlock Filesystem::Impl::superblock() const {
+    return SuperBlock{SUPERBLOCK_MAGIC, SUPERBLOCK_VERSION, block_size, n_device_blocks, n_bitmask_blocks, n_data_blocks,
+                      root_inode_id, refcounts.head(), dedup_head};
+}
+
+// What can't be written to a failing device is dropped, the image is left as the device has it
+void Filesystem::Impl::umount() {
+    try {
+        if (dedup) {
+            dedup_save();
+        }
+        sync();
+    } catch (const DeviceError&) {
+    }
+    dentries.reset();
+    descriptors.reset(); // open descriptors are dropped with the inodes they pin
+    inodes.reset();
+    bitmap.reset();
+    refcounts.reset();
+    dedup_index.reset();
+    dedup = false;
+    cache.reset();
+    journal.reset();
+    device_capacity = -1;
+    n_device_blocks = -1;
+    n_bitmask_blocks = -1;
+    n_data_blocks = -1;
+    device.reset();
+    ++generation;
+}
+
+// number of overflow blocks needed to store the given number of extents
+int Filesystem::Impl::n_extent_blocks(size_t n_extents) const {
+    int n_overflow = static_cast<int>(n_extents) - inode_extents;
+    return n_overflow <= 0 ? 0 : static_cast<int>(div_ceil(n_overflow, extents_per_block));
+}
+
+void Filesystem::Impl::sync() {
+    if (!is_mounted()) {
+        return;
+    }
+    journal_commit();
+    cache.flush();
+    device->sync();
+    lock_guard<mutex> guard{journal.lock};
+    journal_reset();
+}
+
+int Filesystem::Impl::open_inode(const string& path, bool follow_symlink) {
+    Timer timer{stats, Call::Open};
+    shared_lock<shared_mutex> guard{namespace_lock};
+    return pin_inode(find_inode_block_id(path), follow_symlink);
+}
+
+int Filesystem::Impl::open_inode(int inode_id, bool follow_symlink) {
+    Timer timer{stats, Call::Open};
+    shared_lock<shared_mutex> guard{namespace_lock};
+    return pin_inode(inode_id, follow_symlink);
+}
+
+// pinning under namespace_lock makes sure that the inode isn't freed by a concurrent unlink
+int Filesystem::Impl::pin_inode(int inode_id, bool follow_symlink) {
+    assert(inode_id >= 0 && "file not found");
+    assert(is_mounted());
+    if (follow_symlink) {
+        inode_id = inode_follow_symlinks(inode_id);
+    }
+    inodes.pin(inode_id);
+    return inode_id;
+}
+
+// Runs an operation which changes metadata as a part of the running transaction. Transactions are
+// committed by the first operation which finds them big or old enough (group commit) and by sync().
+template <typename Operation>
+void Filesystem::Impl::transaction(Operation operation) {
+    {
+        shared_lock<shared_mutex> guard{commit_lock};
+        operation();
+    }
+    if (journal_join()) {
+        unique_lock<shared_mutex> guard{commit_lock};
+        journal_commit();
+    }
+}
+
+string Filesystem::Impl::cwd() {
+    lock_guard<mutex> guard{cwd_lock};
+    auto it = cwds.find(this_thread::get_id());
+    return it == cwds.end() ? ROOTDIR_NAME : it->second;
+}
+
+void Filesystem::Impl::set_cwd(const string& path) {
+    lock_guard<mutex> guard{cwd_lock};
+    cwds[this_thread::get_id()] = path;
+}
+
+void Filesystem::Impl::read_block(long block_id, char* data, int size, int shift) {
+    if (size == WHOLE_BLOCK) {
+        size = block_size;
+    }
+    Timer timer{stats, stats.block_reads};
+    stats.add(stats.blocks_read, 1);
+    assert(is_mounted());
+    assert(0 <= block_id && block_id < n_device_blocks);
+    assert(0 <= size);
+    assert(0 <= shift);
+    assert(size + shift <= block_size);
+    // mapped devices need no cache, the kernel page cache does the job
+    const char* mapping = device->mapping();
+    if (mapping != nullptr) {
+        const char* page = mapping + block_id * block_size;
+        copy(page + shift, page + shift + size, data);
+        return;
+    }
+    cache.read(block_id, data, size, shift);
+}
+
+// Reads whole consecutive blocks. Blocks which aren't cached are read from the device
+// with one request per run, straight into data and without polluting the cache.
+// With pending the requests are only submitted, the caller waits for them.
+void Filesystem::Impl::read_blocks(long block_id, int n_blocks, char* data, PendingRequests* pending) {
+    Timer timer{stats, stats.block_reads};
+    stats.add(stats.blocks_read, n_blocks);
+    assert(is_mounted());
+    assert(0 <= block_id && block_id + n_blocks <= n_device_blocks);
+    const char* mapping = device->mapping();
+    if (mapping != nullptr) {
+        copy(mapping + block_id * block_size, mapping + (block_id + n_blocks) * block_size, data);
+        return;
+    }
+    int run_start = 0; // first block of the current run of not cached blocks
+    for (int i = 0; i <= n_blocks; ++i) {
+        if (i < n_blocks && !cache.read_cached(block_id + i, data + static_cast<size_t>(i) * block_size)) {
+            continue;
+        }
+        if (run_start < i) {
+            iovec iov{data + static_cast<size_t>(run_start) * block_size, static_cast<size_t>(i - run_start) * block_size};
+            long offset = (block_id + run_start) * block_size;
+            if (pending != nullptr) {
+                pending->add(device->submit_readv(offset, &iov, 1));
+            } else {
+                device->readv(offset, &iov, 1);
+            }
+        }
+        run_start = i + 1;
+    }
+}
+
+// Writes whole consecutive blocks. Cached blocks are updated in the cache,
+// runs of the others go to the device with one request per run (see read_blocks for pending).
+void Filesystem::Impl::write_blocks(long block_id, int n_blocks, const char* data, PendingRequests* pending) {
+    Timer timer{stats, stats.block_writes};
+    stats.add(stats.blocks_written, n_blocks);
+    assert(is_mounted());
+    assert(0 <= block_id && block_id + n_blocks <= n_device_blocks);
+    char* mapping = device->mapping();
+    if (mapping != nullptr) {
+        copy(data, data + static_cast<size_t>(n_blocks) * block_size, mapping + block_id * block_size);
+        return;
+    }
+    int run_start = 0; // first block of the current run of not cached blocks
+    for (int i = 0; i <= n_blocks; ++i) {
+        if (i < n_blocks && !cache.write_cached(block_id + i, data + static_cast<size_t>(i) * block_size)) {
+            continue;
+        }
+        if (run_start < i) {
+            iovec iov{const_cast<char*>(data) + static_cast<size_t>(run_start) * block_size, static_cast<size_t>(i - run_start) * block_size};
+            long offset = (block_id + run_start) * block_size;
+            if (pending != nullptr) {
+                pending->add(device->submit_writev(offset, &iov, 1));
+            } else {
+                device->writev(offset, &iov, 1);
+            }
+        }
+        run_start = i + 1;
+    }
+}
+
+void Filesystem::Impl::read_inode(int block_id, INode* inode) {
+    if (wide) {
+        read_inode_as<int64_t, WideExtent>(block_id, inode);
+    } else {
+        read_inode_as<int, NarrowExtent>(block_id, inode);
+    }
+}
+
+template <typename Size, typename DiskExtent>
+void Filesystem::Impl::read_inode_as(int block_id, INode* inode) {
+    char data[MAX_BLOCK_SIZE];
+    read_metadata_block(block_id, data);
+    const auto& disk_inode = *reinterpret_cast<const DiskINode<Size, DiskExtent>*>(data);
+    if ((disk_inode.type & INODE_MAGIC_MASK) != INODE_MAGIC) {
+        const auto& legacy_inode = *reinterpret_cast<const LegacyINode*>(data);
+        inode->type = legacy_inode.type;
+        inode->n_links = legacy_inode.n_links;
+        inode->size = legacy_inode.size;
+        inode->extents.clear();
+        inode->extent_blocks.clear();
+        inode->inline_data.clear();
+        int n_blocks = static_cast<int>(min<long>(div_ceil(legacy_inode.size, block_size), LEGACY_BLOCKS_PER_INODE));
+        for (int block_index = 0; block_index < n_blocks; ++block_index) {
+            if (legacy_inode.data_block_ids[block_index] != ZERO_BLOCK) {
+                inode_map(*inode, block_index, legacy_inode.data_block_ids[block_index], 1);
+            }
+        }
+        return;
+    }
+
+    inode->type = static_cast<FileType>(disk_inode.type & INODE_TYPE_MASK);
+    inode->n_links = disk_inode.n_links;
+    inode->size = disk_inode.size;
+    if (disk_inode.type & INODE_INLINE) {
+        inode->inline_data.assign(disk_inode.data, disk_inode.data + inline_size);
+        inode->extents.clear();
+        inode->extent_blocks.clear();
+        return;
+    }
+    inode->inline_data.clear();
+    inode->extents.clear();
+    transform(disk_inode.extents, disk_inode.extents + min(disk_inode.n_extents, inode_extents), back_inserter(inode->extents),
+              from_disk<DiskExtent>);
+    inode->extent_blocks.clear();
+    for (int extent_block = disk_inode.extent_block; extent_block != ZERO_BLOCK;) {
+        ExtentBlock<DiskExtent> chain_block;
+        read_metadata_block(extent_block, reinterpret_cast<char*>(&chain_block), block_size);
+        inode->extent_blocks.push_back(extent_block);
+        transform(chain_block.extents, chain_block.extents + chain_block.count, back_inserter(inode->extents),
+                  from_disk<DiskExtent>);
+        extent_block = chain_block.next;
+    }
+    assert(static_cast<int>(inode->extents.size()) == disk_inode.n_extents);
+}
+
+void Filesystem::Impl::write_inode(int block_id, const INode& inode) {
+    if (wide) {
+        write_inode_as<int64_t, WideExtent>(block_id, inode);
+    } else {
+        write_inode_as<int, NarrowExtent>(block_id, inode);
+    }
+}
+
+template <typename Size, typename DiskExtent>
+void Filesystem::Impl::write_inode_as(int block_id, const INode& inode) {
+    assert(static_cast<int>(inode.extent_blocks.size()) == n_extent_blocks(inode.extents.size()));
+    assert(inode.size <= max_file_size);
+    char data[MAX_BLOCK_SIZE] = {};
+    auto& disk_inode = *reinterpret_cast<DiskINode<Size, DiskExtent>*>(data);
+    disk_inode.type = static_cast<int>(inode.type) | INODE_MAGIC;
+    disk_inode.n_links = inode.n_links;
+    disk_inode.size = static_cast<Size>(inode.size);
+    if (!inode.inline_data.empty()) {
+        assert(inode.extents.empty() && static_cast<int>(inode.inline_data.size()) == inline_size);
+        disk_inode.type |= INODE_INLINE;
+        disk_inode.n_extents = 0;
+        disk_inode.extent_block = ZERO_BLOCK;
+        copy(inode.inline_data.begin(), inode.inline_data.end(), disk_inode.data);
+        write_metadata_block(block_id, data);
+        return;
+    }
+    disk_inode.n_extents = static_cast<int>(inode.extents.size());
+    disk_inode.extent_block = inode.extent_blocks.empty() ? ZERO_BLOCK : inode.extent_blocks.front();
+    int n_inline = min(disk_inode.n_extents, inode_extents);
+    transform(inode.extents.begin(), inode.extents.begin() + n_inline, disk_inode.extents, to_disk<DiskExtent>);
+    write_metadata_block(block_id, data);
+
+    for (size_t chain_index = 0; chain_index < inode.extent_blocks.size(); ++chain_index) {
+        ExtentBlock<DiskExtent> chain_block;
+        chain_block.next = chain_index + 1 < inode.extent_blocks.size() ? inode.extent_blocks[chain_index + 1] : ZERO_BLOCK;
+        auto first = inode.extents.begin() + n_inline + chain_index * extents_per_block;
+        chain_block.count = static_cast<int>(min<ptrdiff_t>(extents_per_block, inode.extents.end() - first));
+        transform(first, first + chain_block.count, chain_block.extents, to_disk<DiskExtent>);
+        write_metadata_block(inode.extent_blocks[chain_index], reinterpret_cast<const char*>(&chain_block), block_size);
+    }
+}
+
+// Metadata blocks are read through the running transaction
+void Filesystem::Impl::read_metadata_block(long block_id, char* data, int size, int shift) {
+    if (size == WHOLE_BLOCK) {
+        size = block_size;
+    }
+    if (journal.start != -1) {
+        lock_guard<mutex> guard{journal.lock};
+        auto it = journal.blocks.find(block_id);
+        if (it != journal.blocks.end()) {
+            copy(it->second.begin() + shift, it->second.begin() + shift + size, data);
+            return;
+        }
+    }
+    read_block(block_id, data, size, shift);
+}
+
+// Metadata blocks are written to the running transaction, they go home on commit
+void Filesystem::Impl::write_metadata_block(long block_id, const char* data, int size, int shift) {
+    if (size == WHOLE_BLOCK) {
+        size = block_size;
+    }
+    if (journal.start == -1) {
+        write_block(block_id, data, size, shift);
+        return;
+    }
+    lock_guard<mutex> guard{journal.lock};
+    auto& contents = journal.blocks[block_id];
+    if (contents.empty()) {
+        contents.resize(block_size);
+        if (size != block_size) {
+            read_block(block_id, contents.data());
+        }
+    }
+    copy(data, data + size, contents.begin() + shift);
+}
+
+// directory blocks are metadata, data of the other files is journaled only in blocks freed by the running
+// transaction: their old contents must stay at home until the transaction is committed
+void Filesystem::Impl::read_file_block(const INode& inode, long block_id, char* data, int size, int shift) {
+    if (inode.type == FileType::Directory || journal_holds(block_id, 1)) {
+        read_metadata_block(block_id, data, size, shift);
+    } else {
+        read_block(block_id, data, size, shift);
+    }
+}
+
+void Filesystem::Impl::write_file_block(const INode& inode, long block_id, const char* data, int size, int shift) {
+    if (inode.type == FileType::Directory || journal_holds(block_id, 1)) {
+        write_metadata_block(block_id, data, size, shift);
+    } else {
+        write_block(block_id, data, size, shift);
+    }
+}
+
+// Looks for the journal header right after the root inode
+bool Filesystem::Impl::journal_load() {
+    int start = root_inode_id + 1;
+    if (start >= n_device_blocks) {
+        return false;
+    }
+    char block[MAX_BLOCK_SIZE];
+    device->read(static_cast<long>(start) * block_size, block, block_size);
+    const auto& header = *reinterpret_cast<const JournalHeader*>(block);
+    if (header.magic != JOURNAL_MAGIC || header.n_blocks < JOURNAL_MIN_BLOCKS
+            || header.n_blocks > n_device_blocks - start) {
+        return false;
+    }
+    journal.start = start;
+    journal.n_blocks = header.n_blocks;
+    journal.head = start + 1;
+    journal.sequence = header.sequence;
+    return true;
+}
+
+// Reserves the journal region on a just formatted device (small devices get none)
+void Filesystem::Impl::journal_format() {
+    int n_blocks = static_cast<int>(min<long>(n_data_blocks / JOURNAL_SHARE, JOURNAL_MAX_BLOCKS));
+    if (n_blocks < JOURNAL_MIN_BLOCKS) {
+        return;
+    }
+    int n_allocated;
+    long start = allocate_blocks(root_inode_id + 1, n_blocks, &n_allocated);
+    if (start == BAD_BLOCK) {
+        return;
+    }
+    if (start != root_inode_id + 1 || n_allocated != n_blocks) {
+        free_blocks(start, n_allocated);
+        return;
+    }
+    journal.start = root_inode_id + 1;
+    journal.n_blocks = n_blocks;
+    journal.head = journal.start + 1;
+    journal.sequence = 1;
+    // a log left on the device by an earlier file system must end right away
+    char block[MAX_BLOCK_SIZE] = {};
+    device->write(static_cast<long>(journal.head) * block_size, block, block_size);
+    journal_write_header();
+}
+
+// Writes the committed transactions found in the log to their home locations.
+// The log ends with the first transaction which is incomplete or is left from before the last reset.
+void Filesystem::Impl::journal_replay() {
+    struct Transaction final {
+        uint32_t sequence;
+        int n_descriptor_blocks;
+        vector<char> log;
+    };
+    vector<Transaction> transactions;
+    size_t id_size = wide ? sizeof(int64_t) : sizeof(int);
+    int end = journal.start + journal.n_blocks;
+    while (journal.head < end) {
+        char block[MAX_BLOCK_SIZE];
+        device->read(static_cast<long>(journal.head) * block_size, block, block_size);
+        const auto& descriptor = *reinterpret_cast<const JournalDescriptor*>(block);
+        if (descriptor.magic != JOURNAL_DESCRIPTOR_MAGIC || descriptor.sequence != journal.sequence
+                || descriptor.n_blocks < 0 || descriptor.n_blocks > journal.n_blocks
+                || descriptor.n_revoked < 0 || descriptor.n_revoked > journal.n_blocks * block_size) {
+            break;
+        }
+        int n_ids = descriptor.n_blocks + descriptor.n_revoked;
+        int n_descriptor_blocks = static_cast<int>(div_ceil(sizeof(JournalDescriptor) + n_ids * id_size, block_size));
+        int n_log_blocks = n_descriptor_blocks + descriptor.n_blocks + 1;
+        if (n_log_blocks > end - journal.head) {
+            break;
+        }
+        vector<char> log(static_cast<size_t>(n_log_blocks) * block_size);
+        device->read(static_cast<long>(journal.head) * block_size, log.data(), n_log_blocks * block_size);
+        size_t commit_offset = static_cast<size_t>(n_log_blocks - 1) * block_size;
+        const auto& commit = *reinterpret_cast<const JournalCommit*>(log.data() + commit_offset);
+        if (commit.magic != JOURNAL_COMMIT_MAGIC || commit.sequence != journal.sequence
+                || commit.checksum != checksum(log.data(), commit_offset)) {
+            break;
+        }
+        transactions.push_back(Transaction{journal.sequence, n_descriptor_blocks, move(log)});
+        journal.head += n_log_blocks;
+        ++journal.sequence;
+    }
+
+    // blocks freed by a transaction don't get the contents logged by the earlier ones
+    unordered_map<long, uint32_t> revoked;
+    for (const auto& transaction : transactions) {
+        const auto& descriptor = *reinterpret_cast<const JournalDescriptor*>(transaction.log.data());
+        const char* ids = transaction.log.data() + sizeof(JournalDescriptor);
+        for (int i = descriptor.n_blocks; i < descriptor.n_blocks + descriptor.n_revoked; ++i) {
+            revoked[get_block_id(ids, i, wide)] = transaction.sequence;
+        }
+    }
+    for (const auto& transaction : transactions) {
+        const auto& descriptor = *reinterpret_cast<const JournalDescriptor*>(transaction.log.data());
+        const char* ids = transaction.log.data() + sizeof(JournalDescriptor);
+        for (int i = 0; i < descriptor.n_blocks; ++i) {
+            long block_id = get_block_id(ids, i, wide);
+            auto it = revoked.find(block_id);
+            if (block_id < 0 || block_id >= n_device_blocks || (it != revoked.end() && it->second > transaction.sequence)) {
+                continue;
+            }
+            const char* contents = transaction.log.data() + static_cast<size_t>(transaction.n_descriptor_blocks + i) * block_size;
+            device->write(block_id * block_size, contents, block_size);
+        }
+    }
+    if (!transactions.empty()) {
+        device->sync();
+    }
+    journal_reset();
+}
+
+// true if any of the blocks is in the running transaction or was freed by it
+bool Filesystem::Impl::journal_holds(long block_id, int n_blocks) {
+    if (journal.start == -1) {
+        return false;
+    }
+    lock_guard<mutex> guard{journal.lock};
+    auto logged_block = journal.blocks.lower_bound(block_id);
+    auto freed_block = journal.freed.lower_bound(block_id);
+    return (logged_block != journal.blocks.end() && logged_block->first < block_id + n_blocks)
+            || (freed_block != journal.freed.end() && *freed_block < block_id + n_blocks);
+}
+
+// Adds a finished operation to the running transaction, returns true if it's time to commit it
+bool Filesystem::Impl::journal_join() {
+    if (journal.start == -1) {
+        return false;
+    }
+    lock_guard<mutex> guard{journal.lock};
+    auto now = chrono::steady_clock::now();
+    if (!journal.active) {
+        journal.active = true;
+        journal.opened = now;
+    }
+    return static_cast<int>(journal.blocks.size()) >= journal.n_blocks / 4 || now - journal.opened >= JOURNAL_COMMIT_INTERVAL;
+}
+
+// Writes the running transaction (dirty inodes and bitmask blocks included) to the log with one
+// request, then to the home locations. commit_lock must be held exclusively, so that the transaction
+// is consistent. Without journal the metadata is just written home. A DeviceError (the log couldn't be
+// written or made durable) stops the commit before anything goes home, the transaction stays running.
+void Filesystem::Impl::journal_commit() {
+    inodes.flush();
+    {
+        lock_guard<mutex> guard{allocator_lock};
+        bitmap.flush(*this);
+        refcounts.flush(*this);
+    }
+    if (journal.start == -1) {
+        return;
+    }
+    lock_guard<mutex> guard{journal.lock};
+    if (journal.blocks.empty() && journal.revoked.empty()) {
+        journal.active = false;
+        journal.freed.clear();
+        return;
+    }
+    int n_ids = static_cast<int>(journal.blocks.size() + journal.revoked.size());
+    size_t id_size = wide ? sizeof(int64_t) : sizeof(int);
+    int n_descriptor_blocks = static_cast<int>(div_ceil(sizeof(JournalDescriptor) + n_ids * id_size, block_size));
+    int n_log_blocks = n_descriptor_blocks + static_cast<int>(journal.blocks.size()) + 1;
+    int end = journal.start + journal.n_blocks;
+    if (journal.head + n_log_blocks > end) {
+        // the log is full: make the home copies of the logged blocks durable and start over
+        cache.flush();
+        device->sync();
+        journal_reset();
+    }
+    if (journal.head + n_log_blocks <= end) {
+        vector<char> descriptor(static_cast<size_t>(n_descriptor_blocks) * block_size, '\0');
+        *reinterpret_cast<JournalDescriptor*>(descriptor.data()) = JournalDescriptor{JOURNAL_DESCRIPTOR_MAGIC, journal.sequence,
+                static_cast<int>(journal.blocks.size()), static_cast<int>(journal.revoked.size())};
+        char* ids = descriptor.data() + sizeof(JournalDescriptor);
+        int n_id = 0;
+        for (const auto& kv : journal.blocks) {
+            put_block_id(ids, n_id++, kv.first, wide);
+        }
+        for (long block_id : journal.revoked) {
+            put_block_id(ids, n_id++, block_id, wide);
+        }
+
+        uint32_t hash = checksum(descriptor.data(), descriptor.size());
+        vector<iovec> iov{iovec{descriptor.data(), descriptor.size()}};
+        for (auto& kv : journal.blocks) {
+            hash = checksum(kv.second.data(), block_size, hash);
+            iov.push_back(iovec{kv.second.data(), static_cast<size_t>(block_size)});
+        }
+        char commit[MAX_BLOCK_SIZE] = {};
+        *reinterpret_cast<JournalCommit*>(commit) = JournalCommit{JOURNAL_COMMIT_MAGIC, journal.sequence, hash};
+        iov.push_back(iovec{commit, static_cast<size_t>(block_size)});
+        device->writev(static_cast<long>(journal.head) * block_size, iov.data(), static_cast<int>(iov.size()));
+        device->sync();
+
+        journal.head += n_log_blocks;
+        ++journal.sequence;
+        for (const auto& kv : journal.blocks) {
+            journal.logged.insert(kv.first);
+        }
+    }
+    // otherwise the transaction is larger than the whole log and goes home unprotected
+    journal.active = false;
+    for (const auto& kv : journal.blocks) {
+        write_block(kv.first, kv.second.data());
+    }
+    journal.blocks.clear();
+    journal.revoked.clear();
+    journal.freed.clear();
+}
+
+// Drops freed blocks from the running transaction, copies of them in the log are revoked
+void Filesystem::Impl::journal_forget(long start, int length) {
+    if (journal.start == -1) {
+        return;
+    }
+    lock_guard<mutex> guard{journal.lock};
+    for (long block_id = start; block_id < start + length; ++block_id) {
+        journal.blocks.erase(block_id);
+        journal.freed.insert(block_id);
+        if (journal.logged.erase(block_id) != 0) {
+            journal.revoked.push_back(block_id);
+        }
+    }
+}
+
+// Starts the log over, home copies of everything logged so far must be durable
+void Filesystem::Impl::journal_reset() {
+    if (journal.start == -1 || journal.head == journal.start + 1) {
+        return;
+    }
+    journal.head = journal.start + 1;
+    journal.logged.clear();
+    journal_write_header();
+}
+
+void Filesystem::Impl::journal_write_header() {
+    char block[MAX_BLOCK_SIZE] = {};
+    *reinterpret_cast<JournalHeader*>(block) = JournalHeader{JOURNAL_MAGIC, journal.n_blocks, journal.sequence};
+    device->write(static_cast<long>(journal.start) * block_size, block, block_size);
+    device->sync();
+}
+
+void Filesystem::Impl::write_block(long block_id, const char* data, int size, int shift) {
+    if (size == WHOLE_BLOCK) {
+        size = block_size;
+    }
+    Timer timer{stats, stats.block_writes};
+    stats.add(stats.blocks_written, 1);
+    assert(is_mounted());
+    assert(0 <= block_id && block_id < n_device_blocks);
+    assert(0 <= size);
+    assert(0 <= shift);
+    assert(size + shift <= block_size);
+    char* mapping = device->mapping();
+    if (mapping != nullptr) {
+        copy(data, data + size, mapping + block_id * block_size + shift);
+        return;
+    }
+    cache.write(block_id, data, size, shift);
+}
+
+void Filesystem::Impl::free_blocks(long start, int length) {
+    assert(start >= first_data_block);
+    assert(is_mounted());
+    {
+        lock_guard<mutex> guard{allocator_lock};
+        for (long block_id = start; block_id < start + length; ++block_id) {
+            bitmap.unset(block_id - first_data_block);
+        }
+    }
+    journal_forget(start, length);
+}
+
+bool Filesystem::Impl::share_blocks(long start, int length) {
+    assert(start >= first_data_block);
+    assert(wide);
+    lock_guard<mutex> guard{allocator_lock};
+    for (long block_id = start; block_id < start + length; ++block_id) {
+        assert(bitmap.test(block_id - first_data_block));
+        if (!refcounts.increment(*this, block_id)) {
+            while (block_id-- > start) {
+                refcounts.decrement(*this, block_id);
+            }
+            return false;
+        }
+    }
+    return true;
+}
+
+void Filesystem::Impl::release_blocks(long start, int length) {
+    assert(start >= first_data_block);
+    assert(is_mounted());
+    vector<pair<long, int>> freed; // runs
+    {
+        // freed blocks leave the dedup index before anyone can allocate them
+        unique_lock<mutex> dedup_guard{dedup_lock, defer_lock};
+        if (dedup) {
+            dedup_guard.lock();
+        }
+        lock_guard<mutex> guard{allocator_lock};
+        for (long block_id = start; block_id < start + length; ++block_id) {
+            if (refcounts.get(block_id) > 0) {
+                refcounts.decrement(*this, block_id);
+                continue;
+            }
+            if (dedup) {
+                dedup_index.erase(block_id);
+            }
+            bitmap.unset(block_id - first_data_block);
+            if (!freed.empty() && freed.back().first + freed.back().second == block_id) {
+                ++freed.back().second;
+            } else {
+                freed.emplace_back(block_id, 1);
+            }
+        }
+    }
+    for (const auto& run : freed) {
+        journal_forget(run.first, run.second);
+    }
+}
+
+int Filesystem::Impl::shared_run(long start, int length, bool* shared) {
+    assert(start >= first_data_block);
+    assert(length > 0);
+    lock_guard<mutex> guard{allocator_lock};
+    *shared = refcounts.get(start) > 0;
+    if (refcounts.empty()) {
+        return length;
+    }
+    int n = 1;
+    while (n < length && (refcounts.get(start + n) > 0) == *shared) {
+        ++n;
+    }
+    return n;
+}
+
+// Drops the index saved by the last umount from the device, in dedup mode it's loaded first. The saved
+// index describes the image only until it's changed, so it never outlives a mount.
+void Filesystem::Impl::dedup_load(long head) {
+    vector<char> block(static_cast<size_t>(block_size));
+    int max_entries = static_cast<int>((block_size - sizeof(DedupBlockHeader)) / sizeof(DedupEntry));
+    for (long block_id = head; block_id != 0;) {
+        // freed blocks end a looping chain
+        if (block_id < first_data_block || block_id >= first_data_block + n_data_blocks || !block_used(block_id)) {
+            break;
+        }
+        read_metadata_block(block_id, block.data());
+        const auto& header = *reinterpret_cast<const DedupBlockHeader*>(block.data());
+        if (header.magic != DEDUP_MAGIC || header.n_entries < 0 || header.n_entries > max_entries) {
+            break;
+        }
+        if (dedup) {
+            const auto* entries = reinterpret_cast<const DedupEntry*>(block.data() + sizeof(header));
+            lock_guard<mutex> guard{dedup_lock};
+            for (int i = 0; i < header.n_entries; ++i) {
+                long entry_block_id = entries[i].block_id;
+                if (entry_block_id > root_inode_id && entry_block_id < first_data_block + n_data_blocks) {
+                    dedup_index.insert(entries[i].fingerprint, entry_block_id);
+                }
+            }
+        }
+        long next = header.next;
+        free_blocks(block_id, 1);
+        block_id = next;
+    }
+    if (head != 0) {
+        dedup_head = 0;
+        auto super = superblock();
+        write_metadata_block(0, reinterpret_cast<const char*>(&super), sizeof(super));
+    }
+}
+
+// Writes the index to a chain of blocks which the superblock points to (see dedup_load). A device
+// too full for all of it keeps a part.
+void Filesystem::Impl::dedup_save() {
+    auto entries = dedup_index.entries();
+    size_t max_entries = (block_size - sizeof(DedupBlockHeader)) / sizeof(DedupEntry);
+    vector<char> block(static_cast<size_t>(block_size), '\0');
+    long head = 0;
+    // from the end, so that every block knows the next one
+    for (size_t end = entries.size(); end > 0;) {
+        int n_allocated;
+        long block_id = allocate_blocks(head + 1, 1, &n_allocated);
+        if (block_id == BAD_BLOCK) {
+            break;
+        }
+        size_t begin = end - min(end, max_entries);
+        *reinterpret_cast<DedupBlockHeader*>(block.data()) = DedupBlockHeader{DEDUP_MAGIC, static_cast<int>(end - begin), head};
+        memcpy(block.data() + sizeof(DedupBlockHeader), entries.data() + begin, (end - begin) * sizeof(DedupEntry));
+        write_metadata_block(block_id, block.data());
+        head = block_id;
+        end = begin;
+    }
+    dedup_head = head;
+    auto super = superblock();
+    write_metadata_block(0, reinterpret_cast<const char*>(&super), sizeof(super));
+}
+
+// Maps file_block to the block of the index which holds the same data instead of writing the data.
+// False if there's no such block (or the device is full). Blocks of the index aren't written in place
+// meanwhile: in dedup mode their writers take them out of the index first (see inode_unshare), the
+// offline pass excludes writers.
+bool Filesystem::Impl::dedup_block(INode& inode, int inode_id, int file_block, const char* data, uint64_t fingerprint,
+                                   DedupIndex& index) {
+    long current_block_id = inode_block(inode, file_block);
+    long block_id;
+    {
+        lock_guard<mutex> guard{dedup_lock};
+        block_id = index.find(fingerprint);
+        if (block_id == BAD_BLOCK) {
+            return false;
+        }
+        char block[MAX_BLOCK_SIZE];
+        read_file_block(inode, block_id, block);
+        if (memcmp(block, data, block_size) != 0) {
+            return false;
+        }
+        if (block_id == current_block_id) {
+            return true;
+        }
+        // the remapping splits an extent into up to three
+        if (!inode_reserve_extent_blocks(inode, inode.extents.size() + 2) || !share_blocks(block_id, 1)) {
+            block_id = BAD_BLOCK;
+        }
+    }
+    if (block_id == BAD_BLOCK) {
+        inode_fit_extent_blocks(inode);
+        return false;
+    }
+    inode_unmap(inode, file_block, 1);
+    inode_map(inode, file_block, block_id, 1);
+    inode_fit_extent_blocks(inode);
+    inodes.mark_dirty(inode_id);
+    return true;
+}
+
+void Filesystem::Impl::block_mark_used(long block_id) {
+    assert(block_id >= first_data_block);
+    assert(is_mounted());
+    lock_guard<mutex> guard{allocator_lock};
+    bitmap.set(block_id - first_data_block);
+}
+
+bool Filesystem::Impl::block_used(long block_id) {
+    assert(block_id >= first_data_block);
+    assert(is_mounted());
+    lock_guard<mutex> guard{allocator_lock};
+    return bitmap.test(block_id - first_data_block);
+}
+
+// Allocates the first free block for an inode or an overflow extent block, which are addressed with 32 bits
+// (by directory entries and the chains). BAD_BLOCK if the device is full below block 2^31.
+int Filesystem::Impl::allocate_block() {
+    assert(is_mounted());
+    lock_guard<mutex> guard{allocator_lock};
+    Timer timer{stats, stats.bitmap_scans};
+    long bit = bitmap.find_unset();
+    if (bit == -1 || bit + first_data_block > numeric_limits<int>::max()) {
+        return BAD_BLOCK;
+    }
+    bitmap.set(bit);
+    return static_cast<int>(bit + first_data_block);
+}
+
+// Allocates up to n_blocks consecutive blocks, preferably starting at goal_block.
+// Returns the first one, BAD_BLOCK if the device is full.
+long Filesystem::Impl::allocate_blocks(long goal_block, int n_blocks, int* n_allocated) {
+    assert(n_blocks > 0);
+    long goal = goal_block - first_data_block;
+    if (goal < 0 || goal >= n_data_blocks) {
+        goal = 0;
+    }
+    lock_guard<mutex> guard{allocator_lock};
+    Timer timer{stats, stats.bitmap_scans};
+    long bit = bitmap.find_unset_run(goal, n_blocks, n_allocated);
+    if (bit == -1) {
+        return BAD_BLOCK;
+    }
+    bitmap.set_run(bit, *n_allocated);
+    return bit + first_data_block;
+}
+
+// turns the given blocks of the file into holes and frees the device blocks
+void Filesystem::Impl::inode_unmap(INode& inode, int first_file_block, int n_blocks) {
+    int last_file_block = first_file_block + n_blocks; // exclusive
+    auto it = upper_bound(inode.extents.begin(), inode.extents.end(), first_file_block, [](int block, const Extent& extent) {
+        return block < extent.file_block + extent.length;
+    });
+    while (it != inode.extents.end() && it->file_block < last_file_block) {
+        int from = max(first_file_block, it->file_block);
+        int to = min(last_file_block, it->file_block + it->length);
+        release_blocks(it->start + (from - it->file_block), to - from);
+        Extent head{it->file_block, it->start, from - it->file_block};
+        Extent tail{to, it->start + (to - it->file_block), it->file_block + it->length - to};
+        if (head.length > 0 && tail.length > 0) {
+            *it = head;
+            it = inode.extents.insert(it + 1, tail);
+        } else if (head.length > 0) {
+            *it++ = head;
+        } else if (tail.length > 0) {
+            *it++ = tail;
+        } else {
+            it = inode.extents.erase(it);
+        }
+    }
+}
+
+// allocates or frees overflow blocks so that all the extents can be stored
+bool Filesystem::Impl::inode_fit_extent_blocks(INode& inode) {
+    int n_needed = n_extent_blocks(inode.extents.size());
+    while (static_cast<int>(inode.extent_blocks.size()) > n_needed) {
+        free_blocks(inode.extent_blocks.back(), 1);
+        inode.extent_blocks.pop_back();
+    }
+    while (static_cast<int>(inode.extent_blocks.size()) < n_needed) {
+        int block_id = allocate_block();
+        if (block_id == BAD_BLOCK) {
+            return false;
+        }
+        inode.extent_blocks.push_back(block_id);
+    }
+    return true;
+}
+
+// Allocates device blocks for the holes among [first_file_block, end_file_block), placing them right after
+// the preceding data of the file. Returns the first block which couldn't be allocated (end_file_block on success).
+int Filesystem::Impl::inode_allocate(INode& inode, int inode_id, int first_file_block, int end_file_block) {
+    int file_block = first_file_block;
+    while (file_block < end_file_block) {
+        auto it = upper_bound(inode.extents.begin(), inode.extents.end(), file_block, [](int block, const Extent& extent) {
+            return block < extent.file_block + extent.length;
+        });
+        if (it != inode.extents.end() && it->file_block <= file_block) {
+            file_block = it->file_block + it->length;
+            continue;
+        }
+        int hole_end = it == inode.extents.end() ? end_file_block : min(end_file_block, it->file_block);
+        long prev_block_id = file_block > 0 ? inode_block(inode, file_block - 1) : ZERO_BLOCK;
+        long goal_block = prev_block_id != ZERO_BLOCK ? prev_block_id + 1 : inode_id + 1;
+        int n_allocated;
+        long start = allocate_blocks(goal_block, hole_end - file_block, &n_allocated);
+        if (start == BAD_BLOCK) {
+            return file_block;
+        }
+        inode_map(inode, file_block, start, n_allocated);
+        inodes.mark_dirty(inode_id);
+        if (!inode_fit_extent_blocks(inode)) {
+            inode_unmap(inode, file_block, n_allocated);
+            return file_block;
+        }
+        file_block += n_allocated;
+    }
+    return end_file_block;
+}
+
+// Moves inline data to a block of its own (nothing is allocated if it's all zeros).
+// False if the device is full, the file stays inline then.
+bool Filesystem::Impl::inode_uninline(INode& inode, int inode_id) {
+    assert(!inode.inline_data.empty() && inode.extents.empty());
+    if (!is_zero(inode.inline_data.data(), inline_size)) {
+        int n_allocated;
+        long block_id = allocate_blocks(inode_id + 1, 1, &n_allocated);
+        if (block_id == BAD_BLOCK) {
+            return false;
+        }
+        char block[MAX_BLOCK_SIZE] = {};
+        copy(inode.inline_data.begin(), inode.inline_data.end(), block);
+        write_file_block(inode, block_id, block);
+        inode_map(inode, 0, block_id, 1);
+    }
+    inode.inline_data.clear();
+    inodes.mark_dirty(inode_id);
+    return true;
+}
+
+void Filesystem::Impl::file_read(const INode& inode, char* data, int size, long shift, Readahead* readahead) {
+    assert(is_mounted());
+    assert(0 <= size);
+    assert(0 <= shift);
+    assert(shift + size <= inode.size);
+    if (!inode.inline_data.empty()) {
+        copy(inode.inline_data.begin() + shift, inode.inline_data.begin() + shift + size, data);
+        return;
+    }
+    long ahead_start, ahead_end;
+    long max_window = min<long>(READAHEAD_MAX_SIZE, static_cast<long>(CACHE_PAGES) / 4 * block_size);
+    // mapped devices are read ahead by the kernel
+    if (readahead == nullptr || inode.type != FileType::Regular || device->mapping() != nullptr
+            || !readahead->advance(shift, size, inode.size, max_window, &ahead_start, &ahead_end)) {
+        (this->*file_read_sized)(inode, data, size, shift);
+        return;
+    }
+    // whole blocks of the window go to the block cache (the partial block at its start is cached by the
+    // read itself)
+    vector<pair<long, int>> runs; // device blocks
+    int n_ahead = 0;
+    int last = static_cast<int>(div_ceil(ahead_end, block_size));
+    for (int index = static_cast<int>(div_ceil(ahead_start, block_size)); index < last;) {
+        int n_run;
+        long block_id = inode_run(inode, index, &n_run);
+        n_run = min(n_run, last - index);
+        if (block_id != ZERO_BLOCK && !journal_holds(block_id, n_run)) {
+            runs.emplace_back(block_id, n_run);
+            n_ahead += n_run;
+        }
+        index += n_run;
+    }
+    // the window goes to the device after the requested data, runs of a fragmented file all at once
+    (this->*file_read_sized)(inode, data, size, shift);
+    vector<char> ahead(static_cast<size_t>(n_ahead) * block_size);
+    size_t offset = 0;
+    try {
+        PendingRequests pending;
+        for (const auto& run : runs) {
+            read_blocks(run.first, run.second, ahead.data() + offset, runs.size() > 1 ? &pending : nullptr);
+            offset += static_cast<size_t>(run.second) * block_size;
+        }
+        pending.wait();
+    } catch (const DeviceError&) {
+        // nothing was asked for the window, a block which can't be read fails the read which needs it
+        return;
+    }
+    offset = 0;
+    for (const auto& run : runs) {
+        cache.fill(run.first, run.second, ahead.data() + offset);
+        offset += static_cast<size_t>(run.second) * block_size;
+    }
+}
+
+template <int BlockSize>
+void Filesystem::Impl::file_read_blocks(const INode& inode, char* data, int size, long shift) {
+    assert(is_mounted());
+    assert(0 <= size);
+    assert(0 <= shift);
+    assert(shift + size <= inode.size);
+    // blocks which go through the journal are read one by one (see read_file_block)
+    bool whole_runs = inode.type != FileType::Directory;
+    // a read of several runs submits all of them before waiting, so that the device gets a deep queue
+    PendingRequests pending;
+    int index = 0;
+    while (size > 0) {
+        int block_index = static_cast<int>(shift / BlockSize);
+        int n_run;
+        long block_id = inode_run(inode, block_index, &n_run);
+        int s = static_cast<int>(min<long>(size, (block_index + 1L) * BlockSize - shift));
+        if (s == BlockSize && whole_runs) {
+            // whole blocks: take the rest of the run at once
+            s = min(n_run, size / BlockSize) * BlockSize;
+        }
+        if (block_id != ZERO_BLOCK && whole_runs && shift % BlockSize == 0 && s % BlockSize == 0
+                && !journal_holds(block_id, s / BlockSize)) {
+            read_blocks(block_id, s / BlockSize, data + index, s < size || !pending.empty() ? &pending : nullptr);
+        } else if (block_id != ZERO_BLOCK) {
+            s = min(s, static_cast<int>(BlockSize - shift % BlockSize));
+            read_file_block(inode, block_id, data + index, s, static_cast<int>(shift % BlockSize));
+        } else {
+            // zero data optimization (only nulls in file block)
+            fill(data + index, data + index + s, '\0');
+        }
+        shift += s;
+        size -= s;
+        index += s;
+    }
+    pending.wait();
+}
+
+// Gives the file its own copies of the shared blocks among the ones holding [from, to) (copy on write).
+// Only the blocks which [from, to) covers partly get the old data, the rest is about to be overwritten.
+// False if the device is full, the blocks which were copied by then stay with the file.
+bool Filesystem::Impl::inode_unshare(INode& inode, int inode_id, long from, long to) {
+    int file_block = static_cast<int>(from / block_size);
+    int end_block = static_cast<int>(div_ceil(to, block_size));
+    while (file_block < end_block) {
+        int n_run;
+        long block_id = inode_run(inode, file_block, &n_run);
+        n_run = min(n_run, end_block - file_block);
+        bool shared = false;
+        if (block_id != ZERO_BLOCK) {
+            // blocks written in place leave the dedup index, at once with the check so that they
+            // don't get shared in between (see dedup_block)
+            unique_lock<mutex> dedup_guard{dedup_lock, defer_lock};
+            if (dedup) {
+                dedup_guard.lock();
+            }
+            n_run = shared_run(block_id, n_run, &shared);
+            for (int i = 0; dedup && !shared && i < n_run; ++i) {
+                dedup_index.erase(block_id + i);
+            }
+        }
+        if (!shared) {
+            file_block += n_run;
+            continue;
+        }
+        // the remapping splits an extent into up to three, so there must be room for two more
+        if (!inode_reserve_extent_blocks(inode, inode.extents.size() + 2)) {
+            inode_fit_extent_blocks(inode);
+            return false;
+        }
+        long prev_block_id = file_block > 0 ? inode_block(inode, file_block - 1) : ZERO_BLOCK;
+        int n_allocated;
+        long start = allocate_blocks(prev_block_id != ZERO_BLOCK ? prev_block_id + 1 : inode_id + 1, n_run, &n_allocated);
+        if (start == BAD_BLOCK) {
+            inode_fit_extent_blocks(inode);
+            return false;
+        }
+        for (int i = 0; i < n_allocated; ++i) {
+            long block_from = static_cast<long>(file_block + i) * block_size;
+            if (block_from < from || block_from + block_size > to) {
+                char data[MAX_BLOCK_SIZE];
+                read_file_block(inode, block_id + i, data);
+                write_file_block(inode, start + i, data);
+            }
+        }
+        // the old blocks stay with the other files
+        inode_unmap(inode, file_block, n_allocated);
+        inode_map(inode, file_block, start, n_allocated);
+        inode_fit_extent_blocks(inode);
+        inodes.mark_dirty(inode_id);
+        file_block += n_allocated;
+    }
+    return true;
+}
+
+// Makes the overflow chain long enough for n_extents, so that remapping blocks can't fail half way.
+// False if the device is full.
+bool Filesystem::Impl::inode_reserve_extent_blocks(INode& inode, size_t n_extents) {
+    while (n_extent_blocks(n_extents) > static_cast<int>(inode.extent_blocks.size())) {
+        int extent_block = allocate_block();
+        if (extent_block == BAD_BLOCK) {
+            return false;
+        }
+        inode.extent_blocks.push_back(extent_block);
+    }
+    return true;
+}
+
+// Calls visit(data, size) with consecutive pieces of [shift, shift + size) of the file, one per block.
+// The pieces point into the block cache or the device mapping (see BlockView) and are valid only during
+// the call. visit returns false to stop.
+template <typename Visit>
+void Filesystem::Impl::file_view(const INode& inode, int size, long shift, Visit visit) {
+    assert(is_mounted());
+    assert(0 <= size);
+    assert(0 <= shift);
+    assert(shift + size <= inode.size);
+    if (!inode.inline_data.empty()) {
+        if (size > 0) {
+            visit(inode.inline_data.data() + shift, size);
+        }
+        return;
+    }
+    static const char zeros[MAX_BLOCK_SIZE] = {};
+    while (size > 0) {
+        int block_index = static_cast<int>(shift / block_size);
+        int block_shift = static_cast<int>(shift % block_size);
+        int s = min(size, block_size - block_shift);
+        long block_id = inode_block(inode, block_index);
+        if (block_id == ZERO_BLOCK) {
+            if (!visit(zeros + block_shift, s)) {
+                return;
+            }
+        } else {
+            BlockView view{*this, block_id};
+            if (!visit(view.data() + block_shift, s)) {
+                return;
+            }
+        }
+        shift += s;
+        size -= s;
+    }
+}
+
+string Filesystem::Impl::file_cat(const INode& inode) {
+    string result(static_cast<size_t>(inode.size), '\0');
+    file_read(inode, &result[0], static_cast<int>(inode.size), 0);
+    return result;
+}
+
+// Writes of regular files keep zeros sparse: blocks which would get only zeros stay (or, when
+// overwritten as a whole, become) holes. The rest goes to file_write_blocks in runs.
+bool Filesystem::Impl::file_write(INode& inode, int inode_id, const char* data, int size, long shift) {
+    assert(is_mounted());
+    assert(0 <= size);
+    assert(0 <= shift);
+    assert(shift + size <= inode.size);
+    if (!inode.inline_data.empty()) {
+        if (shift + size <= inline_size) {
+            copy(data, data + size, inode.inline_data.begin() + shift);
+            inodes.mark_dirty(inode_id);
+            return true;
+        }
+        if (!inode_uninline(inode, inode_id)) {
+            // an append which didn't fit: the file keeps its old data
+            inode.size = min<long>(shift, inline_size);
+            inodes.mark_dirty(inode_id);
+            return false;
+        }
+    }
+    if (inode.type != FileType::Regular) {
+        return (this->*file_write_sized)(inode, inode_id, data, size, shift);
+    }
+    enum class Action { Write, Skip, Punch };
+    auto action = [&](int block_index) {
+        long from = max(shift, static_cast<long>(block_index) * block_size);
+        long to = min(shift + size, (block_index + 1L) * block_size);
+        if (!is_zero(data + (from - shift), static_cast<int>(to - from))) {
+            return Action::Write;
+        }
+        if (inode_block(inode, block_index) == ZERO_BLOCK) {
+            return Action::Skip;
+        }
+        // a punched hole may split an extent, which mustn't need a new overflow block
+        // (the tail block past the end of the file is zeros anyway, see file_truncate)
+        bool whole = from == static_cast<long>(block_index) * block_size && (to - from == block_size || to == inode.size);
+        bool fits = n_extent_blocks(inode.extents.size() + 1) <= static_cast<int>(inode.extent_blocks.size());
+        return whole && fits ? Action::Punch : Action::Write;
+    };
+    int first_block = static_cast<int>(shift / block_size);
+    int end_block = static_cast<int>(div_ceil(shift + size, block_size));
+    int block_index = first_block;
+    while (block_index < end_block) {
+        Action run_action = action(block_index);
+        int run_end = block_index + 1;
+        while (run_end < end_block && action(run_end) == run_action) {
+            ++run_end;
+        }
+        if (run_action == Action::Write) {
+            long from = max(shift, static_cast<long>(block_index) * block_size);
+            long to = min(shift + size, static_cast<long>(run_end) * block_size);
+            bool written = dedup ? file_write_deduped(inode, inode_id, data + (from - shift), static_cast<int>(to - from), from)
+                    : inode_unshare(inode, inode_id, from, to)
+                      && (this->*file_write_sized)(inode, inode_id, data + (from - shift), static_cast<int>(to - from), from);
+            if (!written) {
+                return false;
+            }
+        } else if (run_action == Action::Punch) {
+            inode_unmap(inode, block_index, run_end - block_index);
+            inode_fit_extent_blocks(inode);
+            inodes.mark_dirty(inode_id);
+        }
+        block_index = run_end;
+    }
+    return true;
+}
+
+template <int BlockSize>
+bool Filesystem::Impl::file_write_blocks(INode& inode, int inode_id, const char* data, int size, long shift) {
+    assert(is_mounted());
+    assert(0 <= size);
+    assert(0 <= shift);
+    assert(shift + size <= inode.size);
+    if (size == 0) {
+        return true;
+    }
+
+    // reserve space for the whole write at once, so it ends up in as few extents as possible
+    int first_block = static_cast<int>(shift / BlockSize);
+    int end_block = static_cast<int>(div_ceil(shift + size, BlockSize));
+    bool new_head = inode_block(inode, first_block) == ZERO_BLOCK;
+    bool new_tail = inode_block(inode, end_block - 1) == ZERO_BLOCK;
+    int allocated_end = inode_allocate(inode, inode_id, first_block, end_block);
+    if (allocated_end != end_block) {
+        // write what fits, the file ends where the device space ended
+        int n_old_blocks = static_cast<int>(div_ceil(inode.size, BlockSize));
+        inode.size = max(shift, static_cast<long>(allocated_end) * BlockSize);
+        int n_blocks = static_cast<int>(div_ceil(inode.size, BlockSize));
+        inode_unmap(inode, n_blocks, n_old_blocks - n_blocks);
+        inode_fit_extent_blocks(inode);
+        inodes.mark_dirty(inode_id);
+        size = static_cast<int>(inode.size - shift);
+    }
+    // parts of just allocated blocks which aren't overwritten must read as zeros
+    const char zeros[BlockSize] = {};
+    if (new_head && shift % BlockSize != 0 && first_block < allocated_end) {
+        write_file_block(inode, inode_block(inode, first_block), zeros);
+    }
+    if (new_tail && (shift + size) % BlockSize != 0 && end_block == allocated_end) {
+        write_file_block(inode, inode_block(inode, end_block - 1), zeros);
+    }
+
+    bool whole_runs = inode.type != FileType::Directory;
+    PendingRequests pending; // see file_read
+    int index = 0;
+    while (size > 0) {
+        int next_block_index = static_cast<int>(shift / BlockSize);
+        int n_run;
+        long next_block_id = inode_run(inode, next_block_index, &n_run);
+        assert(next_block_id >= 0);
+        int s = static_cast<int>(min<long>(size, (next_block_index + 1L) * BlockSize - shift));
+        if (s == BlockSize && whole_runs) {
+            s = min(n_run, size / BlockSize) * BlockSize;
+        }
+        if (s % BlockSize == 0 && whole_runs && !journal_holds(next_block_id, s / BlockSize)) {
+            write_blocks(next_block_id, s / BlockSize, data + index, s < size || !pending.empty() ? &pending : nullptr);
+        } else {
+            s = min(s, static_cast<int>(BlockSize - shift % BlockSize));
+            write_file_block(inode, next_block_id, data + index, s, static_cast<int>(shift % BlockSize));
+        }
+        shift += s;
+        size -= s;
+        index += s;
+    }
+    pending.wait();
+    return allocated_end == end_block;
+}
+
+// The new part of the file is overwritten as a whole, so unlike truncate + write nothing is zero-filled
+// (except for the parts of a new tail block past the end of the file)
+bool Filesystem::Impl::file_append(INode& inode, int inode_id, const char* data, int size) {
+    assert(0 <= size);
+    if (size > max_file_size - inode.size) {
+        return false;
+    }
+    long shift = inode.size;
+    inode.size += size;
+    inodes.mark_dirty(inode_id);
+    return file_write(inode, inode_id, data, size, shift);
+}
+
+bool Filesystem::Impl::file_write_at(INode& inode, int inode_id, const char* data, int size, long shift) {
+    assert(0 <= size);
+    assert(0 <= shift);
+    if (shift == inode.size) {
+        return file_append(inode, inode_id, data, size);
+    }
+    if (shift + size > inode.size && !file_truncate(inode, inode_id, shift + size)) {
+        return false;
+    }
+    return file_write(inode, inode_id, data, size, shift);
+}
+
+// Write of a regular file in dedup mode: full blocks which the index has a copy of are shared with it
+// instead of being written, the written ones are added to the index
+bool Filesystem::Impl::file_write_deduped(INode& inode, int inode_id, const char* data, int size, long shift) {
+    long end = shift + size;
+    int first_block = static_cast<int>(div_ceil(shift, block_size)); // the first full one
+    vector<uint64_t> fingerprints; // of the full blocks, 0 for zeros (which aren't indexed)
+    for (long from = static_cast<long>(first_block) * block_size; from + block_size <= end; from += block_size) {
+        const char* block = data + (from - shift);
+        fingerprints.push_back(is_zero(block, block_size) ? 0 : fingerprint(block, block_size));
+    }
+    long written = shift;
+    auto write_up_to = [&](long to) {
+        if (to == written) {
+            return true;
+        }
+        if (!inode_unshare(inode, inode_id, written, to)
+                || !(this->*file_write_sized)(inode, inode_id, data + (written - shift), static_cast<int>(to - written), written)) {
+            return false;
+        }
+        lock_guard<mutex> guard{dedup_lock};
+        for (int file_block = static_cast<int>(div_ceil(written, block_size)); (file_block + 1L) * block_size <= to; ++file_block) {
+            uint64_t block_fingerprint = fingerprints[file_block - first_block];
+            long block_id = inode_block(inode, file_block);
+            if (block_fingerprint != 0 && block_id != ZERO_BLOCK) {
+                dedup_index.insert(block_fingerprint, block_id);
+            }
+        }
+        written = to;
+        return true;
+    };
+    for (size_t i = 0; i < fingerprints.size(); ++i) {
+        int file_block = first_block + static_cast<int>(i);
+        long from = static_cast<long>(file_block) * block_size;
+        if (fingerprints[i] != 0 && dedup_block(inode, inode_id, file_block, data + (from - shift), fingerprints[i], dedup_index)) {
+            if (!write_up_to(from)) {
+                return false;
+            }
+            written = from + block_size;
+        }
+    }
+    return write_up_to(end);
+}
+
+bool Filesystem::Impl::file_truncate(INode& inode, int inode_id, long size) {
+    assert(is_mounted());
+    assert(0 <= size);
+    if (size == inode.size) return true;
+    if (size > max_file_size) {
+        return false;
+    }
+
+    if (!inode.inline_data.empty()) {
+        if (size > inline_size && !inode_uninline(inode, inode_id)) {
+            return false;
+        }
+        if (size <= inline_size) {
+            // bytes past the end of an inline file are zeros
+            fill(inode.inline_data.begin() + min(size, inode.size), inode.inline_data.end(), '\0');
+            inode.size = size;
+            inodes.mark_dirty(inode_id);
+            return true;
+        }
+    } else if (size < inode.size && size <= inline_size && inode.type != FileType::Directory) {
+        // files shrunk this much move back into the inode
+        vector<char> inline_data(inline_size, '\0');
+        file_read(inode, inline_data.data(), static_cast<int>(size), 0);
+        inode_unmap(inode, 0, static_cast<int>(div_ceil(inode.size, block_size)));
+        inode_fit_extent_blocks(inode);
+        inode.inline_data = move(inline_data);
+        inode.size = size;
+        inodes.mark_dirty(inode_id);
+        return true;
+    }
+
+    int n_old_blocks = static_cast<int>(div_ceil(inode.size, block_size));
+    int n_blocks = static_cast<int>(div_ceil(size, block_size));
+    if (n_blocks < n_old_blocks) {
+        inode_unmap(inode, n_blocks, n_old_blocks - n_blocks);
+        inode_fit_extent_blocks(inode);
+    } else if (inode.size % block_size != 0) {
+        if (!inode_unshare(inode, inode_id, inode.size, inode.size)) {
+            return false;
+        }
+        long tail_block_id = inode_block(inode, n_old_blocks - 1);
+        if (tail_block_id != ZERO_BLOCK) {
+            char tail_data[MAX_BLOCK_SIZE];
+            read_file_block(inode, tail_block_id, tail_data);
+            fill(tail_data + inode.size % block_size, tail_data + block_size, '\0');
+            write_file_block(inode, tail_block_id, tail_data);
+        }
+    }
+
+    inode.size = size;
+    inodes.mark_dirty(inode_id);
+    return true;
+}
+
+// Like lseek with SEEK_DATA (data == true) or SEEK_HOLE: the first offset >= the given one which is
+// in data or in a hole, the end of the file counts as a hole. -1 if there's no such offset.
+long Filesystem::Impl::file_seek(const INode& inode, long offset, bool data) {
+    assert(is_mounted());
+    if (offset < 0 || offset >= inode.size) {
+        return -1;
+    }
+    if (!inode.inline_data.empty()) {
+        return data ? offset : inode.size;
+    }
+    int n_blocks = static_cast<int>(div_ceil(inode.size, block_size));
+    int block_index = static_cast<int>(offset / block_size);
+    while (block_index < n_blocks) {
+        int n_run;
+        long block_id = inode_run(inode, block_index, &n_run);
+        if ((block_id != ZERO_BLOCK) == data) {
+            return max(offset, static_cast<long>(block_index) * block_size);
+        }
+        if (n_run >= n_blocks - block_index) {
+            break;
+        }
+        block_index += n_run;
+    }
+    return data ? -1 : inode.size;
+}
+
+string Filesystem::Impl::file_stat(const INode& inode, int inode_id) {
+    assert(is_mounted());
+
+    string result = "Type: ";
+    if (inode.type == FileType::Regular) {
+        result += "regular";
+    } else if (inode.type == FileType::Symlink) {
+        result += "symlink\n";
+        result += "Points to: ";
+        result += file_cat(inode);
+    } else {
+        // directory
+        result += "directory\n";
+        result += "Contains files: ";
+        result += to_string(dir_n_files(inode));
+    }
+    result += '\n';
+
+
+    result += "Inode: ";
+    result += to_string(inode_id);
+    result += '\n';
+
+    result += "Blocks uses(";
+    string blocks;
+    int blocks_used = 0;
+    for (const auto& extent : inode.extents) {
+        blocks += '#';
+        blocks += to_string(extent.start);
+        if (extent.length > 1) {
+            blocks += "-#";
+            blocks += to_string(extent.start + extent.length - 1);
+        }
+        blocks += ' ';
+        blocks_used += extent.length;
+    }
+    result += to_string(blocks_used);
+    result += "): ";
+    result += blocks;
+    result += '\n';
+
+    result += "Size: ";
+    result += to_string(inode.size);
+    result += " bytes";
+    result += '\n';
+
+    result += "Number of (hard) links: ";
+    result += to_string(inode.n_links);
+    result += '\n';
+
+    return result;
+}
+
+int Filesystem::Impl::find_inode_block_id(const string& path) {
+    const string absolute_path = path[0] != PATH_SEPARATOR ? join_path(cwd(), path) : path;
+    if (absolute_path == ROOTDIR_NAME) {
+        return root_inode_id;
+    }
+    int inode_id = root_inode_id;
+    size_t start = 1;
+    while (true) {
+        auto sep_index = absolute_path.find(PATH_SEPARATOR, start);
+        if (sep_index == string::npos) {
+            return dir_lookup(inode_id, absolute_path.data() + start, absolute_path.size() - start);
+        }
+        size_t length = sep_index - start;
+        if (length != 1 || absolute_path[start] != '.') {
+            inode_id = dir_lookup(inode_id, absolute_path.data() + start, length);
+            if (inode_id == BAD_BLOCK) {
+                return BAD_BLOCK;
+            }
+        }
+        start = sep_index + 1;
+    }
+}
+
+string Filesystem::Impl::get_file_directory(const string& path) {
+    assert(path != ROOTDIR_NAME);
+    const auto sep_index = path.find_last_of(PATH_SEPARATOR);
+    if (sep_index == string::npos) {
+        return cwd();
+    } else {
+        auto dirname = path.substr(0, sep_index);
+        auto abs_dirname = dirname[0] == PATH_SEPARATOR ? dirname : join_path(cwd(), dirname);
+        return abs_dirname;
+    }
+}
+
+int Filesystem::Impl::dir_lookup(int dir_inode_id, const char* name, size_t length) {
+    if (length > FILENAME_MAX_LENGTH) {
+        return BAD_BLOCK;
+    }
+    dir_inode_id = inode_follow_symlinks(dir_inode_id);
+    if (length == 1 && name[0] == '.') {
+        return dir_inode_id;
+    }
+    int inode_id;
+    if (!dentries.find(dir_inode_id, name, length, &inode_id)) {
+        INodeRef dir{*this, dir_inode_id};
+        inode_id = dir_find_file_inode(*dir, string(name, length));
+        dentries.insert(dir_inode_id, name, length, inode_id);
+    }
+    return inode_id;
+}
+
+int Filesystem::Impl::dir_find_file_inode(const INode& dir, const string& filename) {
+    Timer timer{stats, stats.dir_scans};
+    int n_compared = 0;
+    int result = BAD_BLOCK;
+    if (!dir_is_indexed(dir)) {
+        for (const auto& lnk : dir_links(dir)) {
+            ++n_compared;
+            if (lnk.filename == filename) {
+                result = lnk.inode_block_id;
+                break;
+            }
+        }
+    } else {
+        // walk down the tree over the cached blocks, nothing is copied
+        uint32_t hash = filename_hash(filename.c_str());
+        int node_index = 0;
+        while (true) {
+            BlockView view{*this, inode_block(dir, node_index)};
+            const auto& node = view.as<DirNode>();
+            assert(node.header.magic == DIR_NODE_MAGIC);
+            if (node.header.depth > 0) {
+                node_index = node.entries[dir_index_child(node, hash)].block_index;
+                continue;
+            }
+            for (int n_file = 0; n_file < node.header.count; ++n_file) {
+                ++n_compared;
+                if (filename == node.links[n_file].filename) {
+                    result = node.links[n_file].inode_block_id;
+                    break;
+                }
+            }
+            break;
+        }
+    }
+    stats.add(stats.dir_entries_scanned, n_compared);
+    return result;
+}
+
+bool Filesystem::Impl::dir_is_indexed(const INode& dir) {
+    if (dir.size == 0 || inode_block(dir, 0) == ZERO_BLOCK) {
+        return false;
+    }
+    BlockView view{*this, inode_block(dir, 0)};
+    return view.as<int>() == DIR_NODE_MAGIC;
+}
+
+bool Filesystem::Impl::dir_convert(INodeRef& dir) {
+    auto links = dir_links(*dir);
+    DirNode root;
+    root.header = DirNodeHeader{DIR_NODE_MAGIC, 0, 0, 0};
+    file_truncate(*dir, dir.id(), 0);
+    if (dir_append_node(dir, root) == -1) {
+        return false;
+    }
+    for (const auto& lnk : links) {
+        if (!dir_add_link(dir, lnk)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void Filesystem::Impl::dir_read_node(const INode& dir, int node_index, DirNode* node) {
+    file_read(dir, reinterpret_cast<char*>(node), block_size, node_index * block_size);
+    assert(node->header.magic == DIR_NODE_MAGIC);
+}
+
+bool Filesystem::Impl::dir_write_node(INodeRef& dir, int node_index, const DirNode& node) {
+    return file_write(*dir, dir.id(), reinterpret_cast<const char*>(&node), block_size, node_index * block_size);
+}
+
+int Filesystem::Impl::dir_append_node(INodeRef& dir, const DirNode& node) {
+    long old_size = dir->size;
+    assert(old_size % block_size == 0);
+    int node_index = static_cast<int>(old_size / block_size);
+    file_truncate(*dir, dir.id(), old_size + block_size);
+    if (!dir_write_node(dir, node_index, node)) {
+        file_truncate(*dir, dir.id(), old_size);
+        return -1;
+    }
+    return node_index;
+}
+
+// returns index of the leaf which may contain names with the given hash
+int Filesystem::Impl::dir_find_leaf(const INode& dir, uint32_t hash, DirNode* leaf) {
+    int node_index = 0;
+    dir_read_node(dir, node_index, leaf);
+    while (leaf->header.depth > 0) {
+        node_index = leaf->entries[dir_index_child(*leaf, hash)].block_index;
+        dir_read_node(dir, node_index, leaf);
+    }
+    return node_index;
+}
+
+// Inserts the link into the subtree. If the node had to be split, the new right sibling
+// is appended to the directory file and its index entry is returned through split.
+DirInsertResult Filesystem::Impl::dir_node_insert(INodeRef& dir, int node_index, uint32_t hash, const Link& lnk, DirIndexEntry* split) {
+    DirNode node;
+    dir_read_node(*dir, node_index, &node);
+    DirNode right;
+    right.header = DirNodeHeader{DIR_NODE_MAGIC, node.header.depth, 0, 0};
+
+    if (node.header.depth == 0) {
+        if (node.header.count < links_per_dir_leaf) {
+            node.links[node.header.count++] = lnk;
+            return dir_write_node(dir, node_index, node) ? DirInsertResult::Done : DirInsertResult::Failed;
+        }
+        vector<pair<uint32_t, Link>> links;
+        for (int n_file = 0; n_file < node.header.count; ++n_file) {
+            links.emplace_back(filename_hash(node.links[n_file].filename), node.links[n_file]);
+        }
+        links.emplace_back(hash, lnk);
+        sort(links.begin(), links.end(), [](const pair<uint32_t, Link>& a, const pair<uint32_t, Link>& b) {
+            return a.first < b.first;
+        });
+        // equal hashes must stay in one leaf, so split at the hash boundary closest to the middle
+        int n = static_cast<int>(links.size());
+        int at = -1;
+        for (int d = 0; d <= n / 2 && at == -1; ++d) {
+            if (n / 2 - d > 0 && links[n / 2 - d - 1].first != links[n / 2 - d].first) {
+                at = n / 2 - d;
+            } else if (n / 2 + d < n && links[n / 2 + d - 1].first != links[n / 2 + d].first) {
+                at = n / 2 + d;
+            }
+        }
+        if (at == -1) {
+            return DirInsertResult::Failed;
+        }
+        node.header.count = at;
+        right.header.count = n - at;
+        for (int i = 0; i < n; ++i) {
+            (i < at ? node.links[i] : right.links[i - at]) = links[i].second;
+        }
+        split->hash = links[at].first;
+    } else {
+        int pos = dir_index_child(node, hash);
+        DirIndexEntry child_split;
+        auto result = dir_node_insert(dir, node.entries[pos].block_index, hash, lnk, &child_split);
+        if (result != DirInsertResult::Split) {
+            return result;
+        }
+        if (node.header.count < entries_per_dir_index) {
+            copy_backward(node.entries + pos + 1, node.entries + node.header.count,
+                          node.entries + node.header.count + 1);
+            node.entries[pos + 1] = child_split;
+            ++node.header.count;
+            return dir_write_node(dir, node_index, node) ? DirInsertResult::Done : DirInsertResult::Failed;
+        }
+        vector<DirIndexEntry> entries(node.entries, node.entries + node.header.count);
+        entries.insert(entries.begin() + pos + 1, child_split);
+        int n = static_cast<int>(entries.size());
+        int at = n / 2;
+        node.header.count = at;
+        right.header.count = n - at;
+        copy(entries.begin(), entries.begin() + at, node.entries);
+        copy(entries.begin() + at, entries.end(), right.entries);
+        split->hash = entries[at].hash;
+    }
+
+    // the new node goes first, so a failure leaves the old one intact
+    split->block_index = dir_append_node(dir, right);
+    if (split->block_index == -1 || !dir_write_node(dir, node_index, node)) {
+        return DirInsertResult::Failed;
+    }
+    return DirInsertResult::Split;
+}
+
+bool Filesystem::Impl::dir_add_link(INodeRef& dir, const Link& lnk) {
+    if (!dir_is_indexed(*dir) && !dir_convert(dir)) {
+        return false;
+    }
+    DirIndexEntry split;
+    auto result = dir_node_insert(dir, 0, filename_hash(lnk.filename), lnk, &split);
+    if (result == DirInsertResult::Failed) {
+        return false;
+    }
+    DirNode root;
+    dir_read_node(*dir, 0, &root);
+    if (result == DirInsertResult::Split) {
+        // the root has to stay in the first block: move its left half out and index both halves
+        auto left = root;
+        left.header.n_files = 0;
+        int left_index = dir_append_node(dir, left);
+        if (left_index == -1) {
+            return false;
+        }
+        root.header.depth += 1;
+        root.header.count = 2;
+        root.entries[0] = DirIndexEntry{0, left_index};
+        root.entries[1] = split;
+    }
+    ++root.header.n_files;
+    return dir_write_node(dir, 0, root);
+}
+
+// returns the inode the removed link pointed to
+int Filesystem::Impl::dir_remove_link(INodeRef& dir, const string& filename) {
+    if (!dir_is_indexed(*dir) && !dir_convert(dir)) {
+        return BAD_BLOCK;
+    }
+    DirNode leaf;
+    int leaf_index = dir_find_leaf(*dir, filename_hash(filename.c_str()), &leaf);
+    for (int n_file = 0; n_file < leaf.header.count; ++n_file) {
+        if (leaf.links[n_file].filename == filename) {
+            int inode_id = leaf.links[n_file].inode_block_id;
+            leaf.links[n_file] = leaf.links[--leaf.header.count];
+            dir_write_node(dir, leaf_index, leaf);
+
+            DirNode root;
+            dir_read_node(*dir, 0, &root);
+            --root.header.n_files;
+            dir_write_node(dir, 0, root);
+            return inode_id;
+        }
+    }
+    return BAD_BLOCK;
+}
+
+vector<Link> Filesystem::Impl::dir_links(const INode& dir) {
+    vector<Link> result;
+    if (!dir_is_indexed(dir)) {
+        int dir_size = static_cast<int>(dir.size);
+        assert(dir_size % sizeof(Link) == 0);
+        result.resize(dir_size / sizeof(Link));
+        file_read(dir, reinterpret_cast<char*>(result.data()), dir_size, 0);
+        return result;
+    }
+    dir_for_each_link(dir, [&result](const Link& lnk) {
+        result.push_back(lnk);
+    });
+    return result;
+}
+
+// Calls visit(const Link&) for every link of the directory in the tree order. Links of indexed
+// directories are visited in place in the cached blocks.
+template <typename Visit>
+void Filesystem::Impl::dir_for_each_link(const INode& dir, Visit visit) {
+    if (!dir_is_indexed(dir)) {
+        for (const auto& lnk : dir_links(dir)) {
+            visit(lnk);
+        }
+        return;
+    }
+    vector<int> stack{0};
+    while (!stack.empty()) {
+        BlockView view{*this, inode_block(dir, stack.back())};
+        const auto& node = view.as<DirNode>();
+        assert(node.header.magic == DIR_NODE_MAGIC);
+        stack.pop_back();
+        if (node.header.depth == 0) {
+            for_each(node.links, node.links + node.header.count, visit);
+        } else {
+            for (int i = node.header.count - 1; i >= 0; --i) {
+                stack.push_back(node.entries[i].block_index);
+            }
+        }
+    }
+}
+
+int Filesystem::Impl::dir_n_files(const INode& dir) {
+    if (!dir_is_indexed(dir)) {
+        return static_cast<int>(dir.size / sizeof(Link));
+    }
+    BlockView view{*this, inode_block(dir, 0)};
+    return view.as<DirNodeHeader>().n_files;
+}
+
+int Filesystem::Impl::inode_follow_symlinks(int inode_block_id, int max_follows) {
+    assert(max_follows >= 0);
+    assert(inode_block_id >= 0);
+    string target_name;
+    {
+        INodeRef inode{*this, inode_block_id};
+        shared_lock<shared_mutex> guard{inode->lock};
+        if (inode->type != FileType::Symlink) {
+            return inode_block_id;
+        }
+        target_name = file_cat(*inode);
+    }
+    if (max_follows == 0) {
+        assert(false && "Cyclic reference error");
+        return BAD_BLOCK;
+    }
+    auto linked_inode_block_id = find_inode_block_id(target_name);
+    if (linked_inode_block_id == BAD_BLOCK) {
+        assert(false && "Symbolic link points to nothing");
+        return BAD_BLOCK;
+    }
+    return inode_follow_symlinks(linked_inode_block_id, max_follows - 1);
+}
+
+void Filesystem::Impl::dereference_inode(int inode_id) {
+    // files which are still open are freed on the last close
+    INodeRef inode{*this, inode_id};
+    unique_lock<shared_mutex> guard{inode->lock};
+    --inode->n_links;
+    inodes.mark_dirty(inode_id);
+}
+
+void Filesystem::Impl::release_inode(int inode_id) {
+    INode* orphan = inodes.unpin(inode_id);
+    if (orphan != nullptr) {
+        free_inode(inode_id, *orphan);
+    }
+}
+
+void Filesystem::Impl::free_inode(int inode_id, const INode& inode) {
+    if (inode.type == FileType::Directory) {
+        dentries.erase_dir(inode_id);
+    }
+    for (const auto& extent : inode.extents) {
+        release_blocks(extent.start, extent.length);
+    }
+    for (int extent_block : inode.extent_blocks) {
+        free_blocks(extent_block, 1);
+    }
+    free_blocks(inode_id, 1);
+    inodes.erase(inode_id);
+}
+
+string Filesystem::Impl::ls(const string& dirname) {
+    INodeRef dir{*this, inode_follow_symlinks(find_inode_block_id(dirname))};
+    shared_lock<shared_mutex> guard{dir->lock};
+    string result;
+    dir_for_each_link(*dir, [&result](const Link& lnk) {
+        result += lnk.filename;
+        result += '\n';
+    });
+
+    return result;
+}
+
+int Filesystem::Impl::create(const string& path, FileType type) {
+    if (find_inode_block_id(path) != BAD_BLOCK) {
+        return BAD_BLOCK;
+    }
+
+    auto dirname = get_file_directory(path);
+    auto filename = get_filename(path);
+    if (filename.size() > FILENAME_MAX_LENGTH) {
+        return BAD_BLOCK;
+    }
+
+    int inode_block_id = allocate_block();
+    if (inode_block_id == BAD_BLOCK) {
+        return BAD_BLOCK;
+    }
+
+    INodeRef dir{*this, inode_follow_symlinks(find_inode_block_id(dirname))};
+    unique_lock<shared_mutex> dir_guard{dir->lock};
+
+    // Create link in the parent directory
+    Link lnk;
+    lnk.inode_block_id = inode_block_id;
+    strcpy(lnk.filename, filename.c_str());
+    if (!dir_add_link(dir, lnk)) {
+        free_blocks(inode_block_id, 1);
+        return BAD_BLOCK;
+    }
+    dentries.insert(dir.id(), filename.data(), filename.size(), inode_block_id);
+
+    auto& inode = inodes.add(inode_block_id);
+    {
+        unique_lock<shared_mutex> guard{inode.lock};
+        inode.size = 0;
+        inode.n_links = 1;
+        inode.type = type;
+        if (type != FileType::Directory) {
+            inode.inline_data.assign(inline_size, '\0');
+        }
+    }
+    release_inode(inode_block_id);
+    return inode_block_id;
+}
+
+bool Filesystem::Impl::link(const string& target, const string& name_path) {
+    int target_inode = find_inode_block_id(target);
+    if (target_inode == BAD_BLOCK || find_inode_block_id(name_path) != BAD_BLOCK) {
+        return false;
+    }
+
+    auto dirname = get_file_directory(name_path);
+    auto filename = get_filename(name_path);
+    if (filename.size() > FILENAME_MAX_LENGTH) {
+        return BAD_BLOCK;
+    }
+
+    INodeRef dir{*this, inode_follow_symlinks(find_inode_block_id(dirname))};
+    unique_lock<shared_mutex> dir_guard{dir->lock};
+    Link lnk;
+    strcpy(lnk.filename, filename.c_str());
+    lnk.inode_block_id = target_inode;
+    if (!dir_add_link(dir, lnk)) {
+        return false;
+    }
+    dentries.insert(dir.id(), filename.data(), filename.size(), target_inode);
+    dir_guard.unlock();
+
+    // add link
+    INodeRef inode{*this, target_inode};
+    unique_lock<shared_mutex> guard{inode->lock};
+    inode->n_links += 1;
+    inodes.mark_dirty(target_inode);
+    return true;
+}
+
+bool Filesystem::Impl::unlink(const string& path) {
+    int target_inode = find_inode_block_id(path);
+    if (target_inode == BAD_BLOCK) {
+        return false;
+    }
+
+    auto dirname = get_file_directory(path);
+    auto filename = get_filename(path);
+
+    if (path.size() > FILENAME_MAX_LENGTH) {
+        return false;
+    }
+
+    INodeRef dir{*this, inode_follow_symlinks(find_inode_block_id(dirname))};
+    unique_lock<shared_mutex> dir_guard{dir->lock};
+    int inode_id = dir_remove_link(dir, filename);
+    if (inode_id == BAD_BLOCK) {
+        return false;
+    }
+    dentries.insert(dir.id(), filename.data(), filename.size(), BAD_BLOCK);
+    dir_guard.unlock();
+    dereference_inode(inode_id);
+    return true;
+}
+
+bool Filesystem::Impl::rmdir(const string& dirname) {
+    if (dirname == ROOTDIR_NAME) {
+        return false;
+    }
+    INodeRef dir{*this, inode_follow_symlinks(find_inode_block_id(dirname))};
+    vector<Link> links;
+    {
+        shared_lock<shared_mutex> guard{dir->lock};
+        links = dir_links(*dir);
+    }
+    for (const auto& lnk : links) {
+        dereference_inode(lnk.inode_block_id);
+    }
+    unlink(dirname);
+    return true;
+}
+
+bool Filesystem::Impl::symlink(const string& target, const string& name) {
+    int inode_block_id = create(name, FileType::Symlink);
+    if (inode_block_id == BAD_BLOCK) {
+        return false;
+    }
+    INodeRef file{*this, inode_block_id};
+    unique_lock<shared_mutex> guard{file->lock};
+    file_truncate(*file, inode_block_id, target.size());
+    file_write(*file, inode_block_id, target.c_str(), target.size(), 0);
+    return true;
+}
+
+// The new file shares the data blocks of the source, small files are copied from the inode
+bool Filesystem::Impl::clone(const string& source, const string& path) {
+    int source_id = find_inode_block_id(source);
+    if (source_id == BAD_BLOCK || !wide) {
+        return false;
+    }
+    INodeRef source_inode{*this, inode_follow_symlinks(source_id)};
+    if (source_inode->type != FileType::Regular) {
+        return false;
+    }
+    int inode_id = create(path, FileType::Regular);
+    if (inode_id == BAD_BLOCK) {
+        return false;
+    }
+    INodeRef inode{*this, inode_id};
+    shared_lock<shared_mutex> source_guard{source_inode->lock};
+    unique_lock<shared_mutex> guard{inode->lock};
+    inode->extents = source_inode->extents;
+    bool shared = inode_fit_extent_blocks(*inode);
+    size_t n_shared = 0;
+    while (shared && n_shared < inode->extents.size()) {
+        shared = share_blocks(inode->extents[n_shared].start, inode->extents[n_shared].length);
+        n_shared += shared ? 1 : 0;
+    }
+    if (!shared) {
+        // the device is full, the new file goes away
+        for (size_t i = 0; i < n_shared; ++i) {
+            release_blocks(inode->extents[i].start, inode->extents[i].length);
+        }
+        inode->extents.clear();
+        inode_fit_extent_blocks(*inode);
+        guard.unlock();
+        unlink(path);
+        return false;
+    }
+    inode->size = source_inode->size;
+    inode->inline_data = source_inode->inline_data;
+    inodes.mark_dirty(inode_id);
+    return true;
+}
+
+// Shares the full blocks of a regular file with the blocks of the index which hold the same data, the
+// other blocks are added to the index. Returns how many blocks were remapped.
+long Filesystem::Impl::dedup_file(INode& inode, int inode_id, DedupIndex& index) {
+    constexpr int CHUNK_BLOCKS = 64;
+    vector<char> chunk(static_cast<size_t>(CHUNK_BLOCKS) * block_size);
+    int n_blocks = static_cast<int>(inode.size / block_size); // the tail block isn't full
+    long n_remapped = 0;
+    for (int first = 0; first < n_blocks; first += CHUNK_BLOCKS) {
+        int n = min(CHUNK_BLOCKS, n_blocks - first);
+        (this->*file_read_sized)(inode, chunk.data(), n * block_size, static_cast<long>(first) * block_size);
+        for (int file_block = first; file_block < first + n; ++file_block) {
+            const char* data = chunk.data() + static_cast<size_t>(file_block - first) * block_size;
+            long block_id = inode_block(inode, file_block);
+            if (block_id == ZERO_BLOCK || is_zero(data, block_size)) {
+                continue;
+            }
+            uint64_t block_fingerprint = fingerprint(data, block_size);
+            if (dedup_block(inode, inode_id, file_block, data, block_fingerprint, index)) {
+                n_remapped += inode_block(inode, file_block) != block_id ? 1 : 0;
+            } else {
+                lock_guard<mutex> guard{dedup_lock};
+                index.insert(block_fingerprint, block_id);
+            }
+        }
+    }
+    return n_remapped;
+}
+
+// Offline deduplication of all regular files. Called with commit_lock held exclusively, so nothing
+// is written meanwhile, the changes are committed as they grow. Without dedup mode the pass uses an
+// index of its own, which is dropped afterwards.
+long Filesystem::Impl::dedup_pass() {
+    if (!wide) {
+        return 0;
+    }
+    DedupIndex pass_index;
+    DedupIndex& index = dedup ? dedup_index : pass_index;
+    shared_lock<shared_mutex> guard{namespace_lock};
+    long n_remapped = 0;
+    set<int> visited{root_inode_id};
+    vector<int> pending{root_inode_id};
+    while (!pending.empty()) {
+        INodeRef inode{*this, pending.back()};
+        pending.pop_back();
+        if (inode->type == FileType::Directory) {
+            shared_lock<shared_mutex> dir_guard{inode->lock};
+            dir_for_each_link(*inode, [&](const Link& lnk) {
+                if (visited.insert(lnk.inode_block_id).second) {
+                    pending.push_back(lnk.inode_block_id);
+                }
+            });
+        } else if (inode->type == FileType::Regular) {
+            {
+                unique_lock<shared_mutex> file_guard{inode->lock};
+                n_remapped += dedup_file(*inode, inode.id(), index);
+            }
+            if (journal_join()) {
+                journal_commit();
+            }
+        }
+    }
+    return n_remapped;
+}
+
+long LatencyStats::percentile_ns(double p) const {
+    long rank = max(1L, static_cast<long>(ceil(count * p / 100)));
+    long seen = 0;
+    for (int bucket = 0; bucket < LATENCY_BUCKETS; ++bucket) {
+        seen += buckets[bucket];
+        if (seen >= rank) {
+            return min(max_ns, (2L << bucket) - 1);
+        }
+    }
+    return max_ns;
+}
+
+Filesystem::Filesystem() : impl{new Impl} {
+
+}
+
+Filesystem::~Filesystem() {
+    umount();
+}
+
+bool Filesystem::mount(const string& filename, DeviceMode mode, bool dedup) {
+    Timer timer{impl->stats, Call::Mount};
+    unique_lock<shared_mutex> commit_guard{impl->commit_lock};
+    unique_lock<shared_mutex> guard{impl->namespace_lock};
+    try {
+        return impl->mount(filename, mode, dedup);
+    } catch (const DeviceError&) {
+        impl->umount();
+        return false;
+    }
+}
+
+bool Filesystem::mkfs(const string& filename, int block_size, DeviceMode mode) {
+    Timer timer{impl->stats, Call::Mkfs};
+    unique_lock<shared_mutex> commit_guard{impl->commit_lock};
+    unique_lock<shared_mutex> guard{impl->namespace_lock};
+    return impl->mkfs(filename, block_size, mode);
+}
+
+void Filesystem::umount() {
+    Timer timer{impl->stats, Call::Umount};
+    unique_lock<shared_mutex> commit_guard{impl->commit_lock};
+    unique_lock<shared_mutex> guard{impl->namespace_lock};
+    impl->umount();
+}
+
+void Filesystem::sync() {
+    Timer timer{impl->stats, Call::Sync};
+    unique_lock<shared_mutex> guard{impl->commit_lock};
+    impl->sync();
+}
+
+int Filesystem::block_size() const {
+    assert(impl->is_mounted());
+    return impl->block_size;
+}
+
+CacheStats Filesystem::cache_stats() {
+    return impl->cache.stats();
+}
+
+DeviceStats Filesystem::device_stats() {
+    return impl->is_mounted() ? impl->device->stats() : DeviceStats{};
+}
+
+void Filesystem::enable_stats(bool enabled) {
+    impl->stats.on = enabled;
+}
+
+Stats Filesystem::stats() {
+    return impl->stats.snapshot();
+}
+
+void Filesystem::reset_stats() {
+    impl->stats.reset();
+}
+
+string Filesystem::ls(const string& dirname) {
+    Timer timer{impl->stats, Call::Ls};
+    shared_lock<shared_mutex> guard{impl->namespace_lock};
+    return impl->ls(dirname);
+}
+
+string Filesystem::ls() {
+    return ls(impl->cwd());
+}
+
+int Filesystem::create(const string& path, FileType type) {
+    Timer timer{impl->stats, Call::Create};
+    int result;
+    impl->transaction([&] {
+        unique_lock<shared_mutex> guard{impl->namespace_lock};
+        result = impl->create(path, type);
+    });
+    return result;
+}
+
+bool Filesystem::link(const string& target, const string& name_path) {
+    Timer timer{impl->stats, Call::Link};
+    bool result;
+    impl->transaction([&] {
+        unique_lock<shared_mutex> guard{impl->namespace_lock};
+        result = impl->link(target, name_path);
+    });
+    return result;
+}
+
+bool Filesystem::unlink(const string& path) {
+    Timer timer{impl->stats, Call::Unlink};
+    bool result;
+    impl->transaction([&] {
+        unique_lock<shared_mutex> guard{impl->namespace_lock};
+        result = impl->unlink(path);
+    });
+    return result;
+}
+
+bool Filesystem::file_exists(const string& filename) {
+    Timer timer{impl->stats, Call::FileExists};
+    shared_lock<shared_mutex> guard{impl->namespace_lock};
+    return impl->find_inode_block_id(filename) != BAD_BLOCK;
+}
+
+// lab 4
+bool Filesystem::mkdir(const string& dirname) {
+    Timer timer{impl->stats, Call::Mkdir};
+    int result;
+    impl->transaction([&] {
+        unique_lock<shared_mutex> guard{impl->namespace_lock};
+        result = impl->create(dirname, FileType::Directory);
+    });
+    return result != BAD_BLOCK;
+}
+
+bool Filesystem::rmdir(const string& dirname) {
+    Timer timer{impl->stats, Call::Rmdir};
+    bool result;
+    impl->transaction([&] {
+        unique_lock<shared_mutex> guard{impl->namespace_lock};
+        result = impl->rmdir(dirname);
+    });
+    return result;
+}
+
+bool Filesystem::cd(const string& dirname) {
+    Timer timer{impl->stats, Call::Cd};
+    // fixme VERY bad and ad-hoc solution for paths with ".." and "."
+    auto cwd = impl->cwd();
+    if (dirname == ".") return true;
+    if (dirname == "..") {
+        auto sep_pos = cwd.find_last_of(PATH_SEPARATOR);
+        if (sep_pos == string::npos) {
+            return false;
+        } else if (sep_pos == 0) {
+            impl->set_cwd(ROOTDIR_NAME);
+        } else {
+            impl->set_cwd(cwd.substr(0, sep_pos));
+        }
+        return true;
+    }
+    auto new_cwd = join_path(cwd, dirname);
+    if (!file_exists(new_cwd)) {
+        return false;
+    }
+    impl->set_cwd(new_cwd);
+    return true;
+}
+
+string Filesystem::pwd() {
+    if (impl->is_mounted()) {
+        return impl->cwd();
+    } else {
+        return "NOT MOUNTED!";
+    }
+}
+
+bool Filesystem::symlink(const string& target, const string& name) {
+    Timer timer{impl->stats, Call::Symlink};
+    bool result;
+    impl->transaction([&] {
+        unique_lock<shared_mutex> guard{impl->namespace_lock};
+        result = impl->symlink(target, name);
+    });
+    return result;
+}
+
+bool Filesystem::clone(const string& source, const string& path) {
+    Timer timer{impl->stats, Call::Clone};
+    bool result;
+    impl->transaction([&] {
+        unique_lock<shared_mutex> guard{impl->namespace_lock};
+        result = impl->clone(source, path);
+    });
+    return result;
+}
+
+long Filesystem::dedup() {
+    Timer timer{impl->stats, Call::Dedup};
+    unique_lock<shared_mutex> guard{impl->commit_lock};
+    return impl->dedup_pass();
+}
+
+int Filesystem::open(const string& path, bool follow_symlink) {
+    Timer timer{impl->stats, Call::Open};
+    int inode_id;
+    {
+        shared_lock<shared_mutex> guard{impl->namespace_lock};
+        inode_id = impl->find_inode_block_id(path);
+        if (inode_id == BAD_BLOCK) {
+            return -1;
+        }
+        inode_id = impl->pin_inode(inode_id, follow_symlink);
+    }
+    return impl->descriptors.add(make_shared<Descriptor>(inode_id, impl->inodes.pinned(inode_id)));
+}
+
+long Filesystem::read(int fd, char* data, long size) {
+    Timer timer{impl->stats, Call::Read};
+    auto descriptor = impl->descriptors.find(fd);
+    if (descriptor == nullptr || size < 0) {
+        return -1;
+    }
+    lock_guard<mutex> descriptor_guard{descriptor->lock};
+    INode& inode = descriptor->inode;
+    shared_lock<shared_mutex> guard{inode.lock};
+    if (descriptor->closed || inode.type == FileType::Directory) {
+        return -1;
+    }
+    if (descriptor->offset >= inode.size) {
+        return 0;
+    }
+    long n_read = min(size, inode.size - descriptor->offset);
+    try {
+        in_pieces(n_read, [&](long done, int n) {
+            impl->file_read(inode, data + done, n, descriptor->offset + done, &descriptor->readahead);
+            return true;
+        });
+    } catch (const DeviceError&) {
+        return -1;
+    }
+    descriptor->offset += n_read;
+    return n_read;
+}
+
+long Filesystem::write(int fd, const char* data, long size) {
+    Timer timer{impl->stats, Call::Write};
+    auto descriptor = impl->descriptors.find(fd);
+    if (descriptor == nullptr || size < 0) {
+        return -1;
+    }
+    // an empty write doesn't grow the file even if the position is past the end
+    if (size == 0) {
+        return 0;
+    }
+    lock_guard<mutex> descriptor_guard{descriptor->lock};
+    bool result = false;
+    try {
+        impl->transaction([&] {
+            INode& inode = descriptor->inode;
+            unique_lock<shared_mutex> guard{inode.lock};
+            if (!descriptor->closed && inode.type != FileType::Directory) {
+                result = in_pieces(size, [&](long done, int n) {
+                    return impl->file_write_at(inode, descriptor->inode_id, data + done, n, descriptor->offset + done);
+                });
+            }
+        });
+    } catch (const DeviceError&) {
+        return -1;
+    }
+    if (!result) {
+        return -1;
+    }
+    descriptor->offset += size;
+    return size;
+}
+
+long Filesystem::lseek(int fd, long offset, Whence whence) {
+    Timer timer{impl->stats, Call::Seek};
+    auto descriptor = impl->descriptors.find(fd);
+    if (descriptor == nullptr) {
+        return -1;
+    }
+    lock_guard<mutex> descriptor_guard{descriptor->lock};
+    INode& inode = descriptor->inode;
+    shared_lock<shared_mutex> guard{inode.lock};
+    if (descriptor->closed) {
+        return -1;
+    }
+    long position = -1;
+    switch (whence) {
+    case Whence::Set:
+        position = offset;
+        break;
+    case Whence::Current:
+        position = descriptor->offset + offset;
+        break;
+    case Whence::End:
+        position = inode.size + offset;
+        break;
+    case Whence::Data:
+    case Whence::Hole:
+        position = impl->file_seek(inode, offset, whence == Whence::Data);
+        break;
+    }
+    if (position < 0) {
+        return -1;
+    }
+    descriptor->offset = position;
+    return position;
+}
+
+bool Filesystem::close(int fd) {
+    Timer timer{impl->stats, Call::Close};
+    auto descriptor = impl->descriptors.remove(fd);
+    if (descriptor == nullptr) {
+        return false;
+    }
+    // operations which found the descriptor before it was removed finish first
+    lock_guard<mutex> descriptor_guard{descriptor->lock};
+    descriptor->closed = true;
+    impl->transaction([&] {
+        impl->release_inode(descriptor->inode_id);
+    });
+    return true;
+}
+
+File::File(const string& filename, bool follow_symlink) : File(default_filesystem(), filename, follow_symlink) {
+
+}
+
+File::File(int block_id, bool follow_symlink) : File(default_filesystem(), block_id, follow_symlink) {
+
+}
+
+File::File(Filesystem& fs, const string& filename, bool follow_symlink) :
+        fs{fs}, block_id{fs.impl->open_inode(filename, follow_symlink)}, inode{fs.impl->inodes.pinned(block_id)},
+        generation{fs.impl->generation} {
+
+}
+
+File::File(Filesystem& fs, int block_id, bool follow_symlink) :
+        fs{fs}, block_id{fs.impl->open_inode(block_id, follow_symlink)}, inode{fs.impl->inodes.pinned(this->block_id)},
+        generation{fs.impl->generation} {
+
+}
+
+File::File(const File& other) :
+        fs{other.fs}, block_id{other.block_id}, inode{(assert(!other.stale()), fs.impl->inodes.pin(block_id))},
+        generation{other.generation} {
+    assert(other.opened);
+}
+
+bool File::stale() const {
+    return generation != fs.impl->generation;
+}
+
+string File::filestat() const {
+    Timer timer{fs.impl->stats, Call::Filestat};
+    assert(!stale());
+    shared_lock<shared_mutex> guard{inode.lock};
+    return fs.impl->file_stat(inode, block_id);
+}
+
+bool File::read(char* data, long size, long shift) const {
+    Timer timer{fs.impl->stats, Call::Read};
+    if (stale()) {
+        return false;
+    }
+    shared_lock<shared_mutex> guard{inode.lock};
+    try {
+        in_pieces(size, [&](long done, int n) {
+            fs.impl->file_read(inode, data + done, n, shift + done, &inode.readahead);
+            return true;
+        });
+    } catch (const DeviceError&) {
+        return false;
+    }
+    return true;
+}
+
+string File::cat() const {
+    Timer timer{fs.impl->stats, Call::Cat};
+    assert(!stale());
+    shared_lock<shared_mutex> guard{inode.lock};
+    return fs.impl->file_cat(inode);
+}
+
+void File::view(long size, long shift, const function<bool(string_view)>& visit) const {
+    Timer timer{fs.impl->stats, Call::View};
+    assert(!stale());
+    shared_lock<shared_mutex> guard{inode.lock};
+    in_pieces(size, [&](long done, int n) {
+        bool more = true;
+        fs.impl->file_view(inode, n, shift + done, [&visit, &more](const char* data, int s) {
+            more = visit(string_view{data, static_cast<size_t>(s)});
+            return more;
+        });
+        return more;
+    });
+}
+
+bool File::write(const char* data, long size, long shift) {
+    Timer timer{fs.impl->stats, Call::Write};
+    if (stale()) {
+        return false;
+    }
+    bool result;
+    try {
+        fs.impl->transaction([&] {
+            unique_lock<shared_mutex> guard{inode.lock};
+            result = in_pieces(size, [&](long done, int n) {
+                return fs.impl->file_write(inode, block_id, data + done, n, shift + done);
+            });
+        });
+    } catch (const DeviceError&) {
+        return false;
+    }
+    return result;
+}
+
+bool File::append(const char* data, long size) {
+    Timer timer{fs.impl->stats, Call::Append};
+    if (stale()) {
+        return false;
+    }
+    bool result;
+    try {
+        fs.impl->transaction([&] {
+            unique_lock<shared_mutex> guard{inode.lock};
+            result = in_pieces(size, [&](long done, int n) {
+                return fs.impl->file_append(inode, block_id, data + done, n);
+            });
+        });
+    } catch (const DeviceError&) {
+        return false;
+    }
+    return result;
+}
+
+long File::seek_data(long offset) const {
+    Timer timer{fs.impl->stats, Call::Seek};
+    if (stale()) {
+        return -1;
+    }
+    shared_lock<shared_mutex> guard{inode.lock};
+    return fs.impl->file_seek(inode, offset, true);
+}
+
+long File::seek_hole(long offset) const {
+    Timer timer{fs.impl->stats, Call::Seek};
+    if (stale()) {
+        return -1;
+    }
+    shared_lock<shared_mutex> guard{inode.lock};
+    return fs.impl->file_seek(inode, offset, false);
+}
+
+long File::size() const {
+    assert(!stale());
+    shared_lock<shared_mutex> guard{inode.lock};
+    return inode.size;
+}
+
+FileType File::type() const {
+    assert(!stale());
+    shared_lock<shared_mutex> guard{inode.lock};
+    return inode.type;
+}
+
+int File::inode_id() const {
+    return block_id;
+}
+
+bool File::truncate(long size) {
+    Timer timer{fs.impl->stats, Call::Truncate};
+    if (stale()) {
+        return false;
+    }
+    bool result;
+    try {
+        fs.impl->transaction([&] {
+            unique_lock<shared_mutex> guard{inode.lock};
+            result = fs.impl->file_truncate(inode, block_id, size);
+        });
+    } catch (const DeviceError&) {
+        return false;
+    }
+    return result;
+}
+
+void File::close() {
+    // the inode is kept until the last File referencing it is closed, umount has dropped it already
+    if (opened && !stale()) {
+        Timer timer{fs.impl->stats, Call::Close};
+        fs.impl->transaction([this] {
+            fs.impl->release_inode(block_id);
+        });
+    }
+    opened = false;
+}
+
+File::~File() {
+    close();
+}
+
+FileWriter::FileWriter(File& file, int buffer_size) : file{file}, capacity{max(buffer_size, MAX_BLOCK_SIZE)} {
+    buffer.reserve(static_cast<size_t>(capacity));
+}
+
+FileWriter::~FileWriter() {
+    flush();
+}
+
+bool FileWriter::write(const char* data, long size) {
+    buffer.insert(buffer.end(), data, data + size);
+    if (static_cast<long>(buffer.size()) < capacity) {
+        return true;
+    }
+    // the file ends on a block boundary after the append, so the next one doesn't rewrite a partial block
+    long file_size = file.size();
+    int block_size = file.fs.block_size();
+    long n_bytes = (file_size + static_cast<long>(buffer.size())) / block_size * block_size - file_size;
+    if (!file.append(buffer.data(), n_bytes)) {
+        // the rest must not end up in the file after a gap
+        buffer.clear();
+        return false;
+    }
+    buffer.erase(buffer.begin(), buffer.begin() + n_bytes);
+    return true;
+}
+
+bool FileWriter::write(const string& data) {
+    return write(data.data(), static_cast<long>(data.size()));
+}
+
+bool FileWriter::flush() {
+    if (buffer.empty()) {
+        return true;
+    }
+    bool result = file.append(buffer.data(), static_cast<long>(buffer.size()));
+    buffer.clear();
+    return result;
+}
+
+Filesystem& default_filesystem() {
+    static Filesystem fs;
+    return fs;
+}
+
+bool mount(const string& filename, DeviceMode mode, bool dedup) {
+    return default_filesystem().mount(filename, mode, dedup);
+}
+
+bool mkfs(const string& filename, int block_size, DeviceMode mode) {
+    return default_filesystem().mkfs(filename, block_size, mode);
+}
+
+void umount() {
+    default_filesystem().umount();
+}
+
+void sync() {
+    default_filesystem().sync();
+}
+
+CacheStats cache_stats() {
+    return default_filesystem().cache_stats();
+}
+
+DeviceStats device_stats() {
+    return default_filesystem().device_stats();
+}
+
+void enable_stats(bool enabled) {
+    default_filesystem().enable_stats(enabled);
+}
+
+Stats stats() {
+    return default_filesystem().stats();
+}
+
+void reset_stats() {
+    default_filesystem().reset_stats();
+}
+
+string ls(const string& dirname) {
+    return default_filesystem().ls(dirname);
+}
+
+string ls() {
+    return default_filesystem().ls();
+}
+
+int create(const string& path, FileType type) {
+    return default_filesystem().create(path, type);
+}
+
+bool link(const string& target, const string& name_path) {
+    return default_filesystem().link(target, name_path);
+}
+
+bool unlink(const string& path) {
+    return default_filesystem().unlink(path);
+}
+
+bool file_exists(const string& filename) {
+    return default_filesystem().file_exists(filename);
+}
+
+bool mkdir(const string& dirname) {
+    return default_filesystem().mkdir(dirname);
+}
+
+bool rmdir(const string& dirname) {
+    return default_filesystem().rmdir(dirname);
+}
+
+bool cd(const string& dirname) {
+    return default_filesystem().cd(dirname);
+}
+
+string pwd() {
+    return default_filesystem().pwd();
+}
+
+bool symlink(const string& target, const string& name) {
+    return default_filesystem().symlink(target, name);
+}
+
+bool clone(const string& source, const string& path) {
+    return default_filesystem().clone(source, path);
+}
+
+long dedup() {
+    return default_filesystem().dedup();
+}
+
+int open(const string& path, bool follow_symlink) {
+    return default_filesystem().open(path, follow_symlink);
+}
+
+long read(int fd, char* data, long size) {
+    return default_filesystem().read(fd, data, size);
+}
+
+long write(int fd, const char* data, long size) {
+    return default_filesystem().write(fd, data, size);
+}
+
+long lseek(int fd, long offset, Whence whence) {
+    return default_filesystem().lseek(fd, offset, whence);
+}
+
+bool close(int fd) {
+    return default_filesystem().close(fd);
 }
 } // END OF NAMESPACE myfs
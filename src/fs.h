@@ -1,41 +1,201 @@
 #ifndef FS_H
 #define FS_H
 
+#include <functional>
+#include <memory>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <utility>
 #include <vector>
 
 namespace myfs
 {
 constexpr auto
-    BLOCK_SIZE = 512, // 64 (512)
+    DEFAULT_BLOCK_SIZE = 512, // block size is chosen by mkfs, any power of two in [MIN, MAX]
+    MIN_BLOCK_SIZE = 512,
+    MAX_BLOCK_SIZE = 4096,
     FILENAME_MAX_LENGTH = 15,
-    BLOCKS_PER_INODE = 126, // 14 (126)
-    MAX_SYMLINK_FOLLOWS = 10;
+    MAX_SYMLINK_FOLLOWS = 10,
+    LATENCY_BUCKETS = 40;
 
 constexpr auto PATH_SEPARATOR = '/';
 const std::string ROOTDIR_NAME = "/";
 
 enum class FileType { Regular, Directory, Symlink };
+enum class DeviceMode { Stream, Posix, Mmap };
+// origin of Filesystem::lseek, Data and Hole work like File::seek_data and File::seek_hole
+enum class Whence { Set, Current, End, Data, Hole };
 
+struct CacheStats final {
+    long hits = 0;
+    long misses = 0;
+    long evictions = 0;
+    long writebacks = 0;
+};
+
+// Requests which reached the device. Memory-mapped devices count only the requests
+// which don't go through the mapping (like journal writes)
+struct DeviceStats final {
+    long reads = 0;
+    long writes = 0;
+    long bytes_read = 0;
+    long bytes_written = 0;
+};
+
+// The device failed a request (an I/O error, an image shorter than the file system). Reads and writes
+// of files and descriptors and mount report it by their results, other operations throw it.
+struct DeviceError final : std::runtime_error {
+    using std::runtime_error::runtime_error;
+};
+
+// Latency histogram, bucket i counts the events which took [2^i, 2^(i+1)) ns
+struct LatencyStats final {
+    long count = 0;
+    long total_ns = 0;
+    long max_ns = 0;
+    long buckets[LATENCY_BUCKETS] = {};
+    long percentile_ns(double p) const; // upper bound of the bucket the p-th percentile falls into
+};
+
+// Counters of the hot paths and of the public operations, collected only while enabled
+// (see Filesystem::enable_stats)
+struct Stats final {
+    LatencyStats block_reads; // read requests to the block layer (cache or device)
+    LatencyStats block_writes;
+    long blocks_read = 0;
+    long blocks_written = 0;
+    LatencyStats bitmap_scans; // searches for free blocks
+    LatencyStats dir_scans; // searches of a directory for a filename (dentry cache misses)
+    long dir_entries_scanned = 0; // links compared by the searches
+    std::vector<std::pair<std::string, LatencyStats>> calls; // public operations which were called
+};
+
+struct Filesystem;
+struct INode;
+
+// Open file. Reads of one file may run in parallel, writes and truncates are exclusive.
+// Sizes and offsets in the file are 64-bit, including the sizes of single reads and writes.
+// A File is tied to the mount it was opened in: after umount reads, writes and seeks fail,
+// close does nothing and the other methods must not be called.
 struct File final {
+    // files of the default file system (see default_filesystem())
     File(const std::string& filename, bool follow_symlink = true);
     File(int block_id, bool follow_symlink = true);
+    File(Filesystem& fs, const std::string& filename, bool follow_symlink = true);
+    File(Filesystem& fs, int block_id, bool follow_symlink = true);
+    File(const File& other);
     std::string filestat() const;
-    void read(char* data, int size, int shift) const;
+    bool read(char* data, long size, long shift) const; // false if the device failed
     std::string cat() const;
-    bool write(const char* data, int size, int shift);
-    int size() const;
+    // Calls visit with consecutive pieces of [shift, shift + size) without copying them, the pieces
+    // are valid only during the call. visit returns false to stop.
+    void view(long size, long shift, const std::function<bool(std::string_view)>& visit) const;
+    bool write(const char* data, long size, long shift); // false if the device got full or failed
+    bool append(const char* data, long size); // false if the device (or the size limit) got full or failed, the file keeps what fitted
+    // Next data or hole at or after offset, like lseek with SEEK_DATA and SEEK_HOLE: holes are whole
+    // blocks which were never written or were overwritten with zeros, the end of the file is a hole.
+    // -1 if offset is past the end (or, for seek_data, there's no data after it).
+    long seek_data(long offset) const;
+    long seek_hole(long offset) const;
+    long size() const;
     FileType type() const;
     int inode_id() const;
-    bool truncate(int size);
-    void close() const;
+    bool truncate(long size); // false if the device got full or failed, or the size is past the limit of the image
+    void close();
     ~File();
 private:
+    friend struct FileWriter;
+    bool stale() const; // the file system was unmounted since the file was opened
+    Filesystem& fs;
     const int block_id;
+    INode& inode; // pinned in the inode cache until close(), dangling once stale
+    const long generation; // of the mount (see Filesystem::Impl::generation)
+    bool opened = true;
+};
+
+// Buffered appends to a file. Data is collected in memory and goes to the file with one append
+// (one transaction, one inode update) when the buffer is full, on flush() and on destruction.
+// Appends of a full buffer end on a block boundary, the rest of the data waits for the next one.
+struct FileWriter final {
+    explicit FileWriter(File& file, int buffer_size = 64 * 1024);
+    FileWriter(const FileWriter&) = delete;
+    FileWriter& operator=(const FileWriter&) = delete;
+    ~FileWriter();
+    bool write(const char* data, long size); // false if the device got full, the buffered data is dropped then
+    bool write(const std::string& data);
+    bool flush();
+private:
+    File& file;
+    std::vector<char> buffer;
+    const int capacity;
 };
 
-bool mount(const std::string& filename);
+// Mounted image. Instances are independent of each other and every method except mount/umount
+// may be called from several threads at once. The current directory is kept per thread.
+struct Filesystem final {
+    Filesystem();
+    Filesystem(const Filesystem&) = delete;
+    Filesystem& operator=(const Filesystem&) = delete;
+    ~Filesystem();
+    // With dedup full blocks written to regular files are looked up in an index of fingerprints of the
+    // blocks already stored, a block with the same data is shared (like clone does) instead of being
+    // written. The index lives in RAM and is saved by umount. Ignored on images with 32-bit block numbers.
+    bool mount(const std::string& filename, DeviceMode mode = DeviceMode::Stream, bool dedup = false);
+    // formats the image with the given block size, the file system is left unmounted
+    bool mkfs(const std::string& filename, int block_size = DEFAULT_BLOCK_SIZE, DeviceMode mode = DeviceMode::Stream);
+    void umount();
+    void sync();
+    int block_size() const; // of the mounted image
+    CacheStats cache_stats();
+    DeviceStats device_stats();
+    void enable_stats(bool enabled); // disabled by default, counting costs close to nothing then
+    Stats stats();
+    void reset_stats();
+    std::string ls(const std::string& dirname);
+    std::string ls();
+    int create(const std::string& path, FileType type = FileType::Regular);
+    bool link(const std::string& target, const std::string& name_path);
+    bool unlink(const std::string& path);
+    bool file_exists(const std::string& filename);
+    bool mkdir(const std::string& dirname);
+    bool rmdir(const std::string& dirname);
+    bool cd(const std::string& dirname);
+    std::string pwd();
+    bool symlink(const std::string& target, const std::string& name);
+    // New regular file with the data of source which shares its blocks until one of them is written
+    // (copy on write). Only images made by mkfs with 64-bit block numbers support clones.
+    bool clone(const std::string& source, const std::string& path);
+    // Offline deduplication: shares the blocks of all regular files which hold the same data, returns how
+    // many blocks were given up. Writes wait until it's done. Fills the index in dedup mode.
+    long dedup();
+    // File descriptors: the path is resolved (and symlinks are followed) once by open, the file stays
+    // open until close. read and write go from the position of the descriptor and move it, writes
+    // past the end grow the file. Descriptors are shared by all threads, -1 is returned on errors
+    // (unknown descriptor, missing file, directories for read/write, full or failing device).
+    int open(const std::string& path, bool follow_symlink = true);
+    long read(int fd, char* data, long size); // bytes read, 0 at the end of the file
+    long write(int fd, const char* data, long size);
+    long lseek(int fd, long offset, Whence whence = Whence::Set); // new position
+    bool close(int fd);
+    struct Impl;
+private:
+    friend struct File;
+    std::unique_ptr<Impl> impl;
+};
+
+// instance behind the free functions below
+Filesystem& default_filesystem();
+
+bool mount(const std::string& filename, DeviceMode mode = DeviceMode::Stream, bool dedup = false);
+bool mkfs(const std::string& filename, int block_size = DEFAULT_BLOCK_SIZE, DeviceMode mode = DeviceMode::Stream);
 void umount();
+void sync();
+CacheStats cache_stats();
+DeviceStats device_stats();
+void enable_stats(bool enabled);
+Stats stats();
+void reset_stats();
 std::string ls(const std::string& dirname);
 std::string ls();
 int create(const std::string& path, FileType type = FileType::Regular);
@@ -47,6 +207,13 @@ bool rmdir(const std::string& dirname);
 bool cd(const std::string& dirname);
 std::string pwd();
 bool symlink(const std::string& target, const std::string& name);
+bool clone(const std::string& source, const std::string& path);
+long dedup();
+int open(const std::string& path, bool follow_symlink = true);
+long read(int fd, char* data, long size);
+long write(int fd, const char* data, long size);
+long lseek(int fd, long offset, Whence whence = Whence::Set);
+bool close(int fd);
 } // END OF NAMESPACE myfs
 
 #endif
@@ -1,166 +1,401 @@
 #include "fs.h"
 
+#include <cctype>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <sstream>
 
 using namespace std;
 
-int main() {
+void print_latency(ostream& out, const string& name, const myfs::LatencyStats& latency) {
+    out << name << ": " << latency.count;
+    if (latency.count > 0) {
+        out << fixed << setprecision(1)
+             << ", avg " << latency.total_ns / 1000.0 / latency.count << " us"
+             << ", p50 " << latency.percentile_ns(50) / 1000.0 << " us"
+             << ", p99 " << latency.percentile_ns(99) / 1000.0 << " us"
+             << ", max " << latency.max_ns / 1000.0 << " us";
+    }
+    out << '\n';
+}
+
+void print_stats(ostream& out) {
+    auto stats = myfs::stats();
+    print_latency(out, "Block reads", stats.block_reads);
+    out << "Blocks read: " << stats.blocks_read << '\n';
+    print_latency(out, "Block writes", stats.block_writes);
+    out << "Blocks written: " << stats.blocks_written << '\n';
+    print_latency(out, "Bitmap scans", stats.bitmap_scans);
+    print_latency(out, "Directory scans", stats.dir_scans);
+    out << "Directory entries scanned: " << stats.dir_entries_scanned << '\n';
+    auto cache = myfs::cache_stats();
+    out << "Cache: " << cache.hits << " hits, " << cache.misses << " misses, "
+         << cache.evictions << " evictions, " << cache.writebacks << " writebacks" << '\n';
+    auto device = myfs::device_stats();
+    out << "Device: " << device.reads << " reads (" << device.bytes_read << " bytes), "
+         << device.writes << " writes (" << device.bytes_written << " bytes)" << '\n';
+    for (const auto& call : stats.calls) {
+        print_latency(out, "  " + call.first, call.second);
+    }
+}
+
+// Data of `write` and `append`: words up to "END" in the interactive shell, in batch mode the length,
+// a newline and exactly length bytes
+bool read_data(istream& in, bool batch, string* data) {
+    if (!batch) {
+        bool first = true;
+        while (true) {
+            string s;
+            in >> s;
+            if (s == "END" || in.fail()) break;
+            if (!first) {
+                *data += ' ';
+            }
+            first = false;
+            *data += s;
+        }
+        return true;
+    }
+    int length;
+    in >> length;
+    if (in.fail() || length < 0 || in.get() != '\n') {
+        return false;
+    }
+    data->resize(static_cast<size_t>(length));
+    in.read(&(*data)[0], length);
+    return in.gcount() == length;
+}
+
+// Device mode named among the words of options, fallback if there's none
+myfs::DeviceMode parse_mode(const string& options, myfs::DeviceMode fallback) {
+    if (options.find("mmap") != string::npos) {
+        return myfs::DeviceMode::Mmap;
+    } else if (options.find("posix") != string::npos) {
+        return myfs::DeviceMode::Posix;
+    } else if (options.find("stream") != string::npos) {
+        return myfs::DeviceMode::Stream;
+    }
+    return fallback;
+}
+
+// Runs shell commands from in. The interactive shell prints prompts and flushes the output after every
+// command. Batch mode doesn't prompt and buffers the output; data of `write` and `append` is
+// length-prefixed (see read_data), `cat` answers with the length of the data and the data.
+// With timing every command is reported to stderr as "<command>\t<microseconds>".
+// mkfs formats through the given device mode unless the command names another one.
+void run(istream& in, ostream& out, bool batch, bool timing, myfs::DeviceMode mode) {
     while (true) {
-        cin.clear();
-        cout << ">>> ";
+        in.clear();
+        if (!batch) {
+            out << ">>> " << flush;
+        }
         string cmd;
-        cin >> cmd;
-        if (cin.eof()) {
+        in >> cmd;
+        if (in.eof()) {
             break;
         }
-        if (cmd == "mount") {
-            string fsFileName;
-            cin >> fsFileName;
-            if (myfs::mount(fsFileName)) {
-                cout << "File system mounted!" << endl;
-            } else {
-                cout << "Cannot mount file system!" << endl;
-            }
-        } else if (cmd == "umount") {
-            myfs::umount();
-            cout << "File system unmounted!" << endl;
-        } else if (cmd == "l") {
-            cout << myfs::ls();
-        }  else if (cmd == "ls") {
-            string dirname;
-            cin >> dirname;
-            cout << myfs::ls(dirname);
-        } else if (cmd == "create" || cmd == "touch") {
-            string filename;
-            cin >> filename;
-            if (!myfs::file_exists(filename)) {
-                cout << (myfs::create(filename) >= 0 ? "File created" : "File wasn't created") << endl;
-            } else {
-                cout << "File already exists!" << endl;
-            }
-        } else if (cmd == "link" || cmd == "ln") {
-            string target, name;
-            cin >> target >> name;
-            if (!myfs::file_exists(target)) {
-                cout << "Target file doesn't exist" << endl;
-            } else if (myfs::file_exists(name)) {
-                cout << "File with name '" << name << "' already exists" << endl;
-            } else {
-                cout << (myfs::link(target, name) ? "Link created" : "Link wasn't created") << endl;
-            }
-        } else if (cmd == "unlink" || cmd == "rm") {
-            string filename;
-            cin >> filename;
-            if (!myfs::file_exists(filename)) {
-                cout << "File doesn't exist" << endl;
-            } else if (myfs::File(filename, false).type() == myfs::FileType::Directory) {
-                cout << "Cannot remove directory, use `rmdir` command" << endl;
-            } else {
-                cout << (myfs::unlink(filename) ? "Hard link was removed" : "Hard link wasn't removed") << endl;
-            }
-        } else if (cmd == "mkdir") {
-            string dirname;
-            cin >> dirname;
-            if (myfs::file_exists(dirname)) {
-                cout << "File with name '" << dirname << "' already exists" << endl;
-            } else {
-                cout << (myfs::mkdir(dirname) ? "Dir created" : "Dir wasn't created") << endl;
-            }
-        } else if (cmd == "rmdir") {
-            string dirname;
-            cin >> dirname;
-            if (myfs::file_exists(dirname)) {
-                cout << (myfs::rmdir(dirname) ? "Dir successfully removed" : "Dir wasn't removed") << endl;
-            } else {
-                cout << "Directory doesn't exist";
-            }
-        } else if (cmd == "cd") {
-            string dirname;
-            cin >> dirname;
-            cout << (myfs::cd(dirname) ? "cwd changed" : "Cannot change directory") << endl;
-        } else if (cmd == "pwd") {
-            cout << myfs::pwd() << endl;
-        } else if (cmd == "symlink") {
-            string target, name;
-            cin >> target >> name;
-
-            if (!myfs::file_exists(target)) {
-                cout << "Target file doesn't exist" << endl;
-            } else if (myfs::file_exists(name)) {
-                cout << "File with name '" << name << "' already exists" << endl;
-            } else {
-                cout << (myfs::symlink(target, name) ? "Symlink created" : "Symlink wasn't created") << endl;
-            }
-        } else if (cmd == "filestat" || cmd == "stat") {
-            string filename;
-            cin >> filename;
-            if (myfs::file_exists(filename)) {
-                myfs::File f{filename, false};
-                cout << f.filestat();
-            } else {
-                cout << "File with name '" << filename << "' doesn't exist" << endl;
-            }
-        } else if (cmd == "read" || cmd == "cat") {
-            string filename;
-            cin >> filename;
-            if (myfs::file_exists(filename)) {
-                myfs::File f{filename};
-                if (f.type() != myfs::FileType::Directory) {
-                    cout << f.cat() << endl;
+        auto start = chrono::steady_clock::now();
+        try {
+            if (cmd == "mount") {
+                string fsFileName, options;
+                in >> fsFileName;
+                getline(in, options);
+                auto mount_mode = parse_mode(options, mode);
+                if (myfs::mount(fsFileName, mount_mode, options.find("dedup") != string::npos)) {
+                    out << "File system mounted!" << '\n';
                 } else {
-                    cout << "Cannot read directory" << endl;
+                    out << "Cannot mount file system!" << '\n';
                 }
-            } else {
-                cout << "File with name '" << filename << "' doesn't exist" << endl;
-            }
-        } else if (cmd == "write") {
-            string filename;
-            cin >> filename;
-            string data;
-            bool first = true;
-            while (true) {
-                string s;
-                cin >> s;
-                if (s == "END") break;
-                if (!first) {
-                    data += ' ';
-                }
-                first = false;
-                data += s;
-            }
+            } else if (cmd == "mkfs") {
+                string fsFileName, options;
+                in >> fsFileName;
+                getline(in, options);
+                istringstream options_in(options);
+                int block_size = myfs::DEFAULT_BLOCK_SIZE;
+                string word;
+                while (options_in >> word) {
+                    if (isdigit(static_cast<unsigned char>(word[0]))) {
+                        block_size = atoi(word.c_str());
+                    }
+                }
+                if (myfs::mkfs(fsFileName, block_size, parse_mode(options, mode))) {
+                    out << "File system created with " << block_size << "-byte blocks" << '\n';
+                } else {
+                    out << "Cannot create file system!" << '\n';
+                }
+            } else if (cmd == "umount") {
+                myfs::umount();
+                out << "File system unmounted!" << '\n';
+            } else if (cmd == "sync") {
+                myfs::sync();
+                out << "Cached blocks written to device" << '\n';
+            } else if (cmd == "stats") {
+                string options;
+                getline(in, options);
+                if (options.find("reset") != string::npos) {
+                    myfs::reset_stats();
+                    out << "Statistics reset" << '\n';
+                } else if (options.find("off") != string::npos) {
+                    myfs::enable_stats(false);
+                    out << "Statistics disabled" << '\n';
+                } else if (options.find("on") != string::npos) {
+                    myfs::enable_stats(true);
+                    out << "Statistics enabled" << '\n';
+                } else {
+                    print_stats(out);
+                }
+            } else if (cmd == "l") {
+                out << myfs::ls();
+            }  else if (cmd == "ls") {
+                string dirname;
+                in >> dirname;
+                out << myfs::ls(dirname);
+            } else if (cmd == "create" || cmd == "touch") {
+                string filename;
+                in >> filename;
+                if (!myfs::file_exists(filename)) {
+                    out << (myfs::create(filename) >= 0 ? "File created" : "File wasn't created") << '\n';
+                } else {
+                    out << "File already exists!" << '\n';
+                }
+            } else if (cmd == "link" || cmd == "ln") {
+                string target, name;
+                in >> target >> name;
+                if (!myfs::file_exists(target)) {
+                    out << "Target file doesn't exist" << '\n';
+                } else if (myfs::file_exists(name)) {
+                    out << "File with name '" << name << "' already exists" << '\n';
+                } else {
+                    out << (myfs::link(target, name) ? "Link created" : "Link wasn't created") << '\n';
+                }
+            } else if (cmd == "unlink" || cmd == "rm") {
+                string filename;
+                in >> filename;
+                if (!myfs::file_exists(filename)) {
+                    out << "File doesn't exist" << '\n';
+                } else if (myfs::File(filename, false).type() == myfs::FileType::Directory) {
+                    out << "Cannot remove directory, use `rmdir` command" << '\n';
+                } else {
+                    out << (myfs::unlink(filename) ? "Hard link was removed" : "Hard link wasn't removed") << '\n';
+                }
+            } else if (cmd == "mkdir") {
+                string dirname;
+                in >> dirname;
+                if (myfs::file_exists(dirname)) {
+                    out << "File with name '" << dirname << "' already exists" << '\n';
+                } else {
+                    out << (myfs::mkdir(dirname) ? "Dir created" : "Dir wasn't created") << '\n';
+                }
+            } else if (cmd == "rmdir") {
+                string dirname;
+                in >> dirname;
+                if (myfs::file_exists(dirname)) {
+                    out << (myfs::rmdir(dirname) ? "Dir successfully removed" : "Dir wasn't removed") << '\n';
+                } else {
+                    out << "Directory doesn't exist";
+                }
+            } else if (cmd == "cd") {
+                string dirname;
+                in >> dirname;
+                out << (myfs::cd(dirname) ? "cwd changed" : "Cannot change directory") << '\n';
+            } else if (cmd == "pwd") {
+                out << myfs::pwd() << '\n';
+            } else if (cmd == "symlink") {
+                string target, name;
+                in >> target >> name;
 
-            if (myfs::file_exists(filename)) {
-                myfs::File f{filename};
-                if (f.type() != myfs::FileType::Directory) {
-                    f.truncate(data.size());
-                    if (f.write(data.data(), data.size(), 0)) {
-                        cout << "Data successfully written" << endl;
+                if (!myfs::file_exists(target)) {
+                    out << "Target file doesn't exist" << '\n';
+                } else if (myfs::file_exists(name)) {
+                    out << "File with name '" << name << "' already exists" << '\n';
+                } else {
+                    out << (myfs::symlink(target, name) ? "Symlink created" : "Symlink wasn't created") << '\n';
+                }
+            } else if (cmd == "clone") {
+                string source, name;
+                in >> source >> name;
+                if (!myfs::file_exists(source)) {
+                    out << "Source file doesn't exist" << '\n';
+                } else if (myfs::file_exists(name)) {
+                    out << "File with name '" << name << "' already exists" << '\n';
+                } else {
+                    out << (myfs::clone(source, name) ? "File cloned" : "File wasn't cloned") << '\n';
+                }
+            } else if (cmd == "dedup") {
+                out << myfs::dedup() << " blocks deduplicated" << '\n';
+            } else if (cmd == "filestat" || cmd == "stat") {
+                string filename;
+                in >> filename;
+                if (myfs::file_exists(filename)) {
+                    myfs::File f{filename, false};
+                    out << f.filestat();
+                } else {
+                    out << "File with name '" << filename << "' doesn't exist" << '\n';
+                }
+            } else if (cmd == "read" || cmd == "cat") {
+                string filename;
+                in >> filename;
+                if (myfs::file_exists(filename)) {
+                    myfs::File f{filename};
+                    if (f.type() != myfs::FileType::Directory) {
+                        auto data = f.cat();
+                        if (batch) {
+                            out << data.size() << '\n';
+                        }
+                        out << data << '\n';
                     } else {
-                        cout << "Cannot write data (probably not enough space)" << endl;
+                        out << "Cannot read directory" << '\n';
                     }
                 } else {
-                    cout << "Cannot write to directory" << endl;
+                    out << "File with name '" << filename << "' doesn't exist" << '\n';
+                }
+            } else if (cmd == "write" || cmd == "append") {
+                string filename;
+                in >> filename;
+                string data;
+                if (!read_data(in, batch, &data)) {
+                    out << "Unexpected end of data" << '\n';
+                    break;
                 }
 
+                if (myfs::file_exists(filename)) {
+                    myfs::File f{filename};
+                    if (f.type() != myfs::FileType::Directory) {
+                        bool written;
+                        if (cmd == "append") {
+                            written = f.append(data.data(), data.size());
+                        } else {
+                            f.truncate(data.size());
+                            written = f.write(data.data(), data.size(), 0);
+                        }
+                        if (written) {
+                            out << "Data successfully written" << '\n';
+                        } else {
+                            out << "Cannot write data (probably not enough space)" << '\n';
+                        }
+                    } else {
+                        out << "Cannot write to directory" << '\n';
+                    }
+
+                } else {
+                    out << "File with name '" << filename << "' doesn't exist" << '\n';
+                }
+            } else if (cmd == "truncate") {
+                string filename;
+                long size;
+                in >> filename;
+                in >> size;
+                if (in.fail()) continue;
+                if (myfs::file_exists(filename)) {
+                    myfs::File f{filename};
+                    out << (f.truncate(size) ? "File was truncated" : "File wasn't trucated") << '\n';
+                } else {
+                    out << "File with name '" << filename << "' doesn't exist" << '\n';
+                }
+            } else if (cmd == "map") {
+                // data and hole ranges of the file, [from, to)
+                string filename;
+                in >> filename;
+                if (myfs::file_exists(filename)) {
+                    myfs::File f{filename};
+                    for (long offset = 0; offset < f.size();) {
+                        long data = f.seek_data(offset);
+                        if (data != offset) {
+                            long hole_end = data == -1 ? f.size() : data;
+                            out << "hole " << offset << ' ' << hole_end << '\n';
+                            offset = hole_end;
+                            continue;
+                        }
+                        long hole = f.seek_hole(offset);
+                        out << "data " << offset << ' ' << hole << '\n';
+                        offset = hole;
+                    }
+                } else {
+                    out << "File with name '" << filename << "' doesn't exist" << '\n';
+                }
             } else {
-                cout << "File with name '" << filename << "' doesn't exist" << endl;
+                out << "Uknown command!" << '\n';
             }
-        } else if (cmd == "truncate") {
-            string filename;
-            int size;
-            cin >> filename;
-            cin >> size;
-            if (cin.fail()) continue;
-            if (myfs::file_exists(filename)) {
-                myfs::File f{filename};
-                cout << (f.truncate(size) ? "File was truncated" : "File wasn't trucated") << endl;
-            } else {
-                cout << "File with name '" << filename << "' doesn't exist" << endl;
+        } catch (const myfs::DeviceError& e) {
+            out << "Device error: " << e.what() << '\n';
+        }
+        if (timing) {
+            cerr << cmd << '\t' << chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count() << '\n';
+        }
+        if (!batch) {
+            out << flush;
+        }
+    }
+}
+
+struct Options final {
+    string script; // batch mode if not empty, "-" is stdin
+    string image; // mounted for the whole session if not empty
+    myfs::DeviceMode mode = myfs::DeviceMode::Stream;
+    bool dedup = false; // the image is mounted with dedup
+    bool timing = false;
+};
+
+bool parse_args(int argc, char** argv, Options* options) {
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "-t") {
+            options->timing = true;
+        } else if (arg == "-D") {
+            options->dedup = true;
+        } else if (i + 1 == argc) {
+            return false;
+        } else if (arg == "-f") {
+            options->script = argv[++i];
+        } else if (arg == "-m") {
+            options->image = argv[++i];
+        } else if (arg == "-d") {
+            string mode = argv[++i];
+            if (mode == "mmap") {
+                options->mode = myfs::DeviceMode::Mmap;
+            } else if (mode == "posix") {
+                options->mode = myfs::DeviceMode::Posix;
+            } else if (mode != "stream") {
+                return false;
             }
         } else {
-            cout << "Uknown command!" << endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char** argv) {
+    Options options;
+    if (!parse_args(argc, argv, &options)) {
+        cerr << "usage: " << argv[0] << " [-f script|-] [-m image [-d stream|posix|mmap] [-D]] [-t]" << endl;
+        return EXIT_FAILURE;
+    }
+    if (!options.image.empty() && !myfs::mount(options.image, options.mode, options.dedup)) {
+        cerr << "Cannot mount file system!" << endl;
+        return EXIT_FAILURE;
+    }
+    if (options.script.empty()) {
+        // the interactive shell isn't performance critical, keep the statistics for `stats`
+        myfs::enable_stats(true);
+        run(cin, cout, false, options.timing, options.mode);
+    } else {
+        ios::sync_with_stdio(false);
+        if (options.script == "-") {
+            run(cin, cout, true, options.timing, options.mode);
+        } else {
+            ifstream script{options.script, ios::binary};
+            if (!script) {
+                cerr << "Cannot open " << options.script << endl;
+                return EXIT_FAILURE;
+            }
+            run(script, cout, true, options.timing, options.mode);
         }
     }
     myfs::umount();
+    cout << flush;
     return EXIT_SUCCESS;
 }